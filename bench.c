@@ -0,0 +1,426 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "virtual_alloc.h"
+#include "virtual_sbrk.h"
+
+#define BENCH_HEAP_SIZE 26
+#define BENCH_BLOCK_SIZE 6
+#define BENCH_MAX_THREADS 64
+#define BENCH_LIVE_BLOCKS 32
+#define BENCH_ROUNDS 20000
+#define BENCH_HOT_SIZE 48
+#define BENCH_BUCKETS 976
+#define BENCH_FRAGMENT_MAX 4096
+
+/*
+ * Contended throughput benchmark
+ * Every thread repeatedly allocates BENCH_LIVE_BLOCKS blocks of random size
+ * and frees them again, all threads sharing one virtual heap
+ * The hot size benchmark then has every thread allocate and free one block of
+ * BENCH_HOT_SIZE in a tight loop, at 1, 4, 16 and 64 threads
+ *
+ * The scaling benchmark has every thread pick one of BENCH_LIVE_BLOCKS slots at random,
+ * allocating it if empty, else resizing it one time in four and freeing it otherwise,
+ * and times every call into a histogram, at 1, 2, 4 ... max threads for every heap.
+ * It reports operations per second, the p50, p99 and p999 latencies, and the scaling
+ * efficiency, the throughput at n threads over n times the throughput at 1 thread of the same heap.
+ * The cost of reading the clock is part of every latency and of the throughput.
+ * With a JSON file, its results are written there as well
+ *
+ * The fragmentation benchmark fills one heap until a request fails, frees a random half
+ * of the blocks and fills it again, with the binary buddy and with the weighted buddy engine.
+ * Requests are either just over a power of 2, or of any size up to BENCH_FRAGMENT_MAX.
+ * It reports the blocks placed, the unused part of the IN_USE blocks, the part of the heap left FREE
+ * when a request failed and the part of the heap requested. Heap use is the net effect: the weighted
+ * engine wastes less inside its blocks, but leaves more FREE blocks too small for the next request
+ *
+ * Usage: ./bench [max threads] [rounds per thread] [JSON file]
+ */
+
+void * virtual_heap = NULL;
+int64_t virtual_break = 0;
+
+void * virtual_sbrk(int32_t increment) {
+    void * ret = virtual_heap + virtual_break;
+    virtual_break = virtual_break + increment;
+    return ret;
+}
+
+//how the heap is shared, one per benchmark row
+#define SHARE_SINGLE 0  //plain heap used by one thread, the single threaded baseline
+#define SHARE_MUTEX 1   //plain heap behind one pthread mutex, as callers do without MODE_THREAD_SAFE
+#define SHARE_MODE 2    //heap initialized with MODE_THREAD_SAFE
+#define SHARE_SUBTREE 3 //heap initialized with MODE_SUBTREE_LOCKS
+#define SHARE_TCACHE 4  //heap initialized with MODE_THREAD_SAFE and MODE_TCACHE
+#define SHARE_LOCK_FREE 5 //heap initialized with MODE_THREAD_SAFE and MODE_LOCK_FREE
+#define SHARE_ARENAS 6  //heap initialized with one arena for each CPU
+#define SHARE_MAINTENANCE 7 //heap initialized with MODE_THREAD_SAFE, with a maintenance thread
+
+const char * share_names[] = {"single threaded", "outer pthread mutex", "MODE_THREAD_SAFE", "MODE_SUBTREE_LOCKS",
+                              "MODE_TCACHE", "MODE_LOCK_FREE", "per-CPU arenas", "maintenance thread"};
+
+//what every thread does, one per benchmark table
+#define WORKLOAD_CHURN 0    //allocate BENCH_LIVE_BLOCKS blocks, then free them
+#define WORKLOAD_HOT 1      //allocate and free one block of BENCH_HOT_SIZE
+#define WORKLOAD_MIXED 2    //random malloc, realloc and free, every call timed
+
+pthread_mutex_t outer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct bench_thread {
+    pthread_t thread;
+    int share;
+    int workload;
+    uint32_t seed;
+    long rounds;
+    long ops;
+    uint64_t latency[BENCH_BUCKETS];    //number of calls taking each range of nanoseconds
+};
+
+uint32_t next_random(uint32_t * seed){
+    //xorshift, so threads do not share the state of rand()
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+void * bench_malloc(int share, uint32_t size){
+    if (share == SHARE_MUTEX){
+        pthread_mutex_lock(&outer_lock);
+        void * ptr = virtual_malloc(virtual_heap,size);
+        pthread_mutex_unlock(&outer_lock);
+        return ptr;
+    }
+    return virtual_malloc(virtual_heap,size);
+}
+
+void bench_free(int share, void * ptr){
+    if (share == SHARE_MUTEX){
+        pthread_mutex_lock(&outer_lock);
+        virtual_free(virtual_heap,ptr);
+        pthread_mutex_unlock(&outer_lock);
+        return;
+    }
+    virtual_free(virtual_heap,ptr);
+}
+
+void * bench_realloc(int share, void * ptr, uint32_t size){
+    if (share == SHARE_MUTEX){
+        pthread_mutex_lock(&outer_lock);
+        void * new_ptr = virtual_realloc(virtual_heap,ptr,size);
+        pthread_mutex_unlock(&outer_lock);
+        return new_ptr;
+    }
+    return virtual_realloc(virtual_heap,ptr,size);
+}
+
+double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int latency_bucket(uint64_t ns){
+    //log-linear buckets, 16 for each power of 2, so a bucket is within 1/16 of its values
+    if (ns < 16){
+        return ns;
+    }
+    int power = 63 - __builtin_clzll(ns);
+    return (power - 3) * 16 + ((ns >> (power - 4)) & 15);
+}
+
+uint64_t bucket_floor(int bucket){
+    //the smallest number of nanoseconds in a bucket
+    if (bucket < 16){
+        return bucket;
+    }
+    return (uint64_t) (16 + bucket % 16) << (bucket / 16 - 1);
+}
+
+uint64_t percentile(const uint64_t * latency, double fraction){
+    //the latency no more than the given fraction of calls were faster than
+    uint64_t total = 0;
+    for (int i = 0; i < BENCH_BUCKETS; i++){
+        total += latency[i];
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < BENCH_BUCKETS; i++){
+        seen += latency[i];
+        if (seen > 0 && seen >= fraction * total){
+            return bucket_floor(i);
+        }
+    }
+    return 0;
+}
+
+void mixed_worker(struct bench_thread * t){
+    void * live[BENCH_LIVE_BLOCKS] = {NULL};
+    for (long op = 0; op < t->rounds * BENCH_LIVE_BLOCKS; op++){
+        uint32_t random = next_random(&t->seed);
+        int slot = random % BENCH_LIVE_BLOCKS;
+        uint32_t size = 16 + (random >> 8) % 2048;
+        uint64_t begin = now_ns();
+        if (live[slot] == NULL){
+            live[slot] = bench_malloc(t->share, size);
+        } else if ((random >> 24) % 4 == 0){
+            void * ptr = bench_realloc(t->share, live[slot], size);
+            if (ptr != NULL){
+                live[slot] = ptr;
+            }
+        } else {
+            bench_free(t->share, live[slot]);
+            live[slot] = NULL;
+        }
+        t->latency[latency_bucket(now_ns() - begin)] ++;
+    }
+    for (int i = 0; i < BENCH_LIVE_BLOCKS; i++){
+        if (live[i] != NULL){
+            bench_free(t->share, live[i]);
+        }
+    }
+    t->ops += t->rounds * BENCH_LIVE_BLOCKS;
+}
+
+void * bench_worker(void * arg){
+    struct bench_thread * t = arg;
+    void * live[BENCH_LIVE_BLOCKS];
+    if (t->workload == WORKLOAD_MIXED){
+        mixed_worker(t);
+        return NULL;
+    }
+    if (t->workload == WORKLOAD_HOT){
+        for (long round = 0; round < t->rounds * BENCH_LIVE_BLOCKS; round++){
+            void * ptr = bench_malloc(t->share, BENCH_HOT_SIZE);
+            if (ptr != NULL){
+                bench_free(t->share, ptr);
+            }
+        }
+        t->ops += 2 * t->rounds * BENCH_LIVE_BLOCKS;
+        return NULL;
+    }
+    for (long round = 0; round < t->rounds; round++){
+        for (int i = 0; i < BENCH_LIVE_BLOCKS; i++){
+            live[i] = bench_malloc(t->share, 16 + next_random(&t->seed) % 2048);
+        }
+        for (int i = 0; i < BENCH_LIVE_BLOCKS; i++){
+            if (live[i] != NULL){
+                bench_free(t->share, live[i]);
+            }
+        }
+        t->ops += 2 * BENCH_LIVE_BLOCKS;
+    }
+    return NULL;
+}
+
+struct bench_thread bench_threads[BENCH_MAX_THREADS];
+
+uint32_t fragment_size(uint32_t * seed, int over_power){
+    //a request just over a power of 2 from 2^(BENCH_BLOCK_SIZE) up, or of any size
+    if (over_power){
+        uint32_t power = pow_of_2(BENCH_BLOCK_SIZE + next_random(seed) % 6);
+        return power + 1 + next_random(seed) % (power / 2);
+    }
+    return 1 + next_random(seed) % BENCH_FRAGMENT_MAX;
+}
+
+size_t fragment(int weighted, int over_power, double * waste, double * left, double * use){
+    //fill, free half and refill a fresh heap, return the number of blocks placed
+    virtual_break = 0;
+    if (weighted){
+        init_allocator_weighted(virtual_heap, BENCH_HEAP_SIZE, BENCH_BLOCK_SIZE, MODE_STATS);
+    } else {
+        init_allocator_mode(virtual_heap, BENCH_HEAP_SIZE, BENCH_BLOCK_SIZE, MODE_STATS);
+    }
+    size_t capacity = pow_of_2(BENCH_HEAP_SIZE - BENCH_BLOCK_SIZE);
+    void ** blocks = malloc(capacity * sizeof(void *));
+    uint32_t * sizes = malloc(capacity * sizeof(uint32_t));
+    uint32_t seed = 1;
+    uint64_t requested = 0;
+    size_t placed = 0;
+    size_t n = 0;
+    for (int pass = 0; pass < 2; pass++){
+        while (n < capacity){
+            uint32_t size = fragment_size(&seed, over_power);
+            void * ptr = virtual_malloc(virtual_heap, size);
+            if (ptr == NULL){
+                break;
+            }
+            blocks[n] = ptr;
+            sizes[n] = size;
+            requested += size;
+            placed ++;
+            n ++;
+        }
+        for (size_t i = 0; pass == 0 && i < n;){
+            //free a random half, the last block takes the place of a freed one
+            if (next_random(&seed) & 1){
+                virtual_free(virtual_heap, blocks[i]);
+                requested -= sizes[i];
+                n --;
+                blocks[i] = blocks[n];
+                sizes[i] = sizes[n];
+            } else {
+                i ++;
+            }
+        }
+    }
+    STATS stats;
+    virtual_stats(virtual_heap, &stats);
+    *waste = 1 - (double) requested / stats.used_size;
+    *left = (double) stats.free_size / pow_of_2(BENCH_HEAP_SIZE);
+    *use = (double) requested / pow_of_2(BENCH_HEAP_SIZE);
+    free(blocks);
+    free(sizes);
+    return placed;
+}
+
+double run(int share, int threads, long rounds, int workload, uint64_t * latency){
+    //run one configuration on a fresh heap, return operations per second, and add up the latencies if asked
+    virtual_break = 0;
+    uint8_t mode = MODE_BITMAP;
+    if (share == SHARE_MODE || share == SHARE_MAINTENANCE){
+        mode = MODE_THREAD_SAFE;
+    } else if (share == SHARE_SUBTREE){
+        mode = MODE_TREE | MODE_SUBTREE_LOCKS;
+    } else if (share == SHARE_TCACHE){
+        mode = MODE_THREAD_SAFE | MODE_TCACHE;
+    } else if (share == SHARE_LOCK_FREE){
+        mode = MODE_THREAD_SAFE | MODE_LOCK_FREE;
+    }
+    if (share == SHARE_ARENAS){
+        init_allocator_arenas(virtual_heap, BENCH_HEAP_SIZE, BENCH_BLOCK_SIZE, MODE_BITMAP, 0);
+    } else {
+        init_allocator_mode(virtual_heap, BENCH_HEAP_SIZE, BENCH_BLOCK_SIZE, mode);
+    }
+
+    double begin = now();
+    if (share == SHARE_MAINTENANCE){
+        virtual_maintenance_start(virtual_heap, 64, 1, 0);
+    }
+    for (int i = 0; i < threads; i++){
+        bench_threads[i].share = share;
+        bench_threads[i].workload = workload;
+        bench_threads[i].seed = 2463534242u + i;
+        bench_threads[i].rounds = rounds;
+        bench_threads[i].ops = 0;
+        memset(bench_threads[i].latency, 0, sizeof(bench_threads[i].latency));
+        pthread_create(&bench_threads[i].thread, NULL, bench_worker, &bench_threads[i]);
+    }
+    long ops = 0;
+    for (int i = 0; i < threads; i++){
+        pthread_join(bench_threads[i].thread, NULL);
+        ops += bench_threads[i].ops;
+        for (int j = 0; latency != NULL && j < BENCH_BUCKETS; j++){
+            latency[j] += bench_threads[i].latency[j];
+        }
+    }
+    if (share == SHARE_MAINTENANCE){
+        //the merges left to the thread are part of the work
+        virtual_maintenance_stop(virtual_heap);
+    }
+    return ops / (now() - begin);
+}
+
+int main(int argc, char ** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    long rounds = argc > 2 ? atol(argv[2]) : BENCH_ROUNDS;
+    FILE * json = NULL;
+    if (argc > 3 && (json = fopen(argv[3], "w")) == NULL){
+        perror(argv[3]);
+        return 1;
+    }
+    if (max_threads < 1 || max_threads > BENCH_MAX_THREADS){
+        max_threads = 8;
+    }
+
+    //room for the allocating space and the allocator data structures behind it
+    virtual_heap = aligned_alloc(64, pow_of_2(BENCH_HEAP_SIZE + 1));
+
+    double baseline = run(SHARE_SINGLE, 1, rounds, WORKLOAD_CHURN, NULL);
+    printf("%-24s %8s %14s %10s\n", "heap", "threads", "ops/sec", "vs single");
+    printf("%-24s %8d %14.0f %9.2fx\n", "single threaded", 1, baseline, 1.0);
+    for (int threads = 1; threads <= max_threads; threads *= 2){
+        double mutex = run(SHARE_MUTEX, threads, rounds, WORKLOAD_CHURN, NULL);
+        double mode = run(SHARE_MODE, threads, rounds, WORKLOAD_CHURN, NULL);
+        double subtree = run(SHARE_SUBTREE, threads, rounds, WORKLOAD_CHURN, NULL);
+        double tcache = run(SHARE_TCACHE, threads, rounds, WORKLOAD_CHURN, NULL);
+        double lock_free = run(SHARE_LOCK_FREE, threads, rounds, WORKLOAD_CHURN, NULL);
+        double arenas = run(SHARE_ARENAS, threads, rounds, WORKLOAD_CHURN, NULL);
+        printf("%-24s %8d %14.0f %9.2fx\n", "outer pthread mutex", threads, mutex, mutex / baseline);
+        printf("%-24s %8d %14.0f %9.2fx\n", "MODE_THREAD_SAFE", threads, mode, mode / baseline);
+        printf("%-24s %8d %14.0f %9.2fx\n", "MODE_SUBTREE_LOCKS", threads, subtree, subtree / baseline);
+        printf("%-24s %8d %14.0f %9.2fx\n", "MODE_TCACHE", threads, tcache, tcache / baseline);
+        printf("%-24s %8d %14.0f %9.2fx\n", "MODE_LOCK_FREE", threads, lock_free, lock_free / baseline);
+        printf("%-24s %8d %14.0f %9.2fx\n", "per-CPU arenas", threads, arenas, arenas / baseline);
+    }
+
+    //one hot size, where the free stacks of MODE_LOCK_FREE replace the heap lock
+    double hot_baseline = run(SHARE_SINGLE, 1, rounds, WORKLOAD_HOT, NULL);
+    printf("\n%-24s %8s %14s %10s\n", "hot size heap", "threads", "ops/sec", "vs single");
+    printf("%-24s %8d %14.0f %9.2fx\n", "single threaded", 1, hot_baseline, 1.0);
+    for (int threads = 1; threads <= BENCH_MAX_THREADS; threads *= 4){
+        double mode = run(SHARE_MODE, threads, rounds, WORKLOAD_HOT, NULL);
+        double lock_free = run(SHARE_LOCK_FREE, threads, rounds, WORKLOAD_HOT, NULL);
+        printf("%-24s %8d %14.0f %9.2fx\n", "MODE_THREAD_SAFE", threads, mode, mode / hot_baseline);
+        printf("%-24s %8d %14.0f %9.2fx\n", "MODE_LOCK_FREE", threads, lock_free, lock_free / hot_baseline);
+    }
+
+    //every heap from 1 to max threads, with latencies
+    printf("\n%-24s %8s %14s %10s %10s %10s %10s\n", "scaling heap", "threads", "ops/sec", "p50 ns", "p99 ns", "p999 ns", "efficiency");
+    if (json != NULL){
+        fprintf(json, "{\n  \"heap_size\": %d,\n  \"block_size\": %d,\n  \"rounds\": %ld,\n  \"scaling\": [",
+                BENCH_HEAP_SIZE, BENCH_BLOCK_SIZE, rounds);
+    }
+    int rows = 0;
+    for (int share = SHARE_MUTEX; share <= SHARE_MAINTENANCE; share++){
+        double single = 0;
+        for (int threads = 1; threads <= max_threads; threads *= 2){
+            uint64_t latency[BENCH_BUCKETS] = {0};
+            double ops = run(share, threads, rounds, WORKLOAD_MIXED, latency);
+            if (threads == 1){
+                single = ops;
+            }
+            double efficiency = ops / (threads * single);
+            uint64_t p50 = percentile(latency, 0.5);
+            uint64_t p99 = percentile(latency, 0.99);
+            uint64_t p999 = percentile(latency, 0.999);
+            printf("%-24s %8d %14.0f %10lu %10lu %10lu %9.1f%%\n",
+                   share_names[share], threads, ops, p50, p99, p999, efficiency * 100);
+            if (json != NULL){
+                fprintf(json, "%s\n    {\"heap\": \"%s\", \"threads\": %d, \"ops_per_sec\": %.0f, "
+                        "\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"efficiency\": %.4f}",
+                        rows > 0 ? "," : "", share_names[share], threads, ops, p50, p99, p999, efficiency);
+            }
+            rows ++;
+        }
+    }
+    if (json != NULL){
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+
+    //the binary buddy against the weighted buddy engine, single threaded
+    printf("\n%-24s %-16s %10s %10s %10s %10s\n", "fragmentation heap", "requests", "blocks", "unused", "free left", "heap use");
+    for (int over_power = 1; over_power >= 0; over_power--){
+        for (int weighted = 0; weighted <= 1; weighted++){
+            double waste, left, use;
+            size_t placed = fragment(weighted, over_power, &waste, &left, &use);
+            printf("%-24s %-16s %10zu %9.1f%% %9.1f%% %9.1f%%\n", weighted ? "weighted buddy" : "binary buddy",
+                   over_power ? "just over 2^k" : "any size", placed, waste * 100, left * 100, use * 100);
+        }
+    }
+
+    free(virtual_heap);
+    return 0;
+}
@@ -2,6 +2,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
+#include <pthread.h>
 #include <stdint.h>
 
 #include "virtual_alloc.h"
@@ -17,6 +18,9 @@
 #define NORMAL_BLOCK_SIZE 10
 #define SMALL_BLOCK_SIZE 8
 
+#define TEST_THREADS 4
+#define TEST_ROUNDS 2000
+
 void * virtual_heap = NULL;
 
 void * virtual_sbrk(int32_t increment) {
@@ -175,6 +179,47 @@ static void test_virtual_malloc_3(void **state) {
     }
 }
 
+static void test_virtual_malloc_batch_1(void **state) {
+    init_allocator(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE);
+    uint32_t sizes[3] = {1022, 1024, 1025};
+    void * blocks[3];
+
+    assert_int_equal(virtual_malloc_batch(virtual_heap,sizes,blocks,3),0);
+    assert_int_equal(blocks[1]-blocks[0],1024);
+    assert_int_equal(blocks[2]-blocks[1],1024);
+
+    //use temporary file to store the output
+    freopen("test/out","w",stdout);
+    virtual_info(virtual_heap);
+    freopen("/dev/tty","w",stdout);
+
+    //placed exactly like three calls to virtual_malloc
+    if (compare_heap_info("test/test_virtual_malloc_1") != 0){
+        fail_msg("heap structure not matched!");
+    }
+}
+
+static void test_virtual_malloc_batch_2(void **state) {
+    init_allocator(virtual_heap, SMALL_HEAP_SIZE, NORMAL_BLOCK_SIZE);
+    uint32_t sizes[3] = {1022, 1024, 1025};
+    void * blocks[3];
+
+    //the third block does not fit, so the first two are given back
+    assert_int_equal(virtual_malloc_batch(virtual_heap,sizes,blocks,3),1);
+    assert_null(blocks[0]);
+    assert_null(blocks[1]);
+    assert_null(blocks[2]);
+
+    //use temporary file to store the output
+    freopen("test/out","w",stdout);
+    virtual_info(virtual_heap);
+    freopen("/dev/tty","w",stdout);
+
+    if (compare_heap_info("test/test_virtual_init_3") != 0){
+        fail_msg("heap structure not matched!");
+    }
+}
+
 static void test_virtual_free_1(void **state) {
     init_allocator(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE);
     void * block1 = virtual_malloc(virtual_heap,1022);
@@ -233,6 +278,31 @@ static void test_virtual_free_3(void **state) {
     }
 }
 
+static void test_virtual_free_batch_1(void **state) {
+    init_allocator(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE);
+    void * blocks[3];
+    blocks[0] = virtual_malloc(virtual_heap,1025);
+    blocks[1] = virtual_malloc(virtual_heap,1022);
+    blocks[2] = virtual_malloc(virtual_heap,1024);
+    void * invalid[2] = {blocks[1], blocks[1] + 1};
+
+    //nothing is freed if one pointer is not a block
+    assert_int_equal(virtual_free_batch(virtual_heap,invalid,2),1);
+    assert_int_equal(virtual_free_batch(virtual_heap,blocks,3),0);
+    assert_null(blocks[0]);
+    assert_null(blocks[1]);
+    assert_null(blocks[2]);
+
+    //use temporary file to store the output
+    freopen("test/out","w",stdout);
+    virtual_info(virtual_heap);
+    freopen("/dev/tty","w",stdout);
+
+    if (compare_heap_info("test/test_virtual_init_1") != 0){
+        fail_msg("heap structure not matched!");
+    }
+}
+
 static void test_virtual_realloc_1(void **state) {
     init_allocator(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE);
     void * block1 = virtual_malloc(virtual_heap,1022);
@@ -339,6 +409,842 @@ static void test_virtual_realloc_3(void **state) {
     }
 }
 
+static void test_virtual_realloc_4(void **state) {
+    init_allocator(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE);
+    void * block1 = virtual_malloc(virtual_heap,1024);
+    memset(block1,7,1024);
+
+    //use temporary file to store the output
+    freopen("test/out","w",stdout);
+    virtual_info(virtual_heap);
+
+    //grow by absorbing the free right buddies
+    void * block2 = virtual_realloc(virtual_heap,block1,4000);
+    virtual_info(virtual_heap);
+
+    //shrink by freeing the right halves
+    void * block3 = virtual_realloc(virtual_heap,block2,2000);
+    virtual_info(virtual_heap);
+
+    //same size after rounding
+    void * block4 = virtual_realloc(virtual_heap,block3,1025);
+    virtual_info(virtual_heap);
+    freopen("/dev/tty","w",stdout);
+
+    assert_ptr_equal(block2,block1);
+    assert_ptr_equal(block3,block1);
+    assert_ptr_equal(block4,block1);
+    assert_int_equal(((uint8_t *)block4)[1023],7);
+
+    if (compare_heap_info("test/test_virtual_realloc_4") != 0){
+        fail_msg("heap structure not matched!");
+    }
+}
+
+static void test_virtual_tree_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE, MODE_TREE);
+    void * block1 = virtual_malloc(virtual_heap,1022);
+    void * block2 = virtual_malloc(virtual_heap,1024);
+    void * block3 = virtual_malloc(virtual_heap,1025);
+
+    assert_int_equal(block2-block1,1024);
+    assert_int_equal(block3-block2,1024);
+
+    //use temporary file to store the output
+    freopen("test/out","w",stdout);
+    virtual_info(virtual_heap);
+    virtual_free(virtual_heap,block2);
+    virtual_info(virtual_heap);
+    virtual_free(virtual_heap,block1);
+    virtual_info(virtual_heap);
+    virtual_free(virtual_heap,block3);
+    virtual_info(virtual_heap);
+
+    freopen("/dev/tty","w",stdout);
+
+    //the tree engine places blocks exactly like the bitmap engine
+    if (compare_heap_info("test/test_virtual_free_1") != 0){
+        fail_msg("heap structure not matched!");
+    }
+}
+
+static void test_virtual_paranoid_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE, MODE_PARANOID);
+    void * block1 = virtual_malloc(virtual_heap,1024);
+    assert_non_null(block1);
+
+    //the block map is the last structure below the program break, one entry per 1024 bytes
+    HEADER * map = virtual_sbrk(0) - pow_of_2(NORMAL_HEAP_SIZE - NORMAL_BLOCK_SIZE);
+    //turn the allocated block into a free one behind the allocator's back
+    map[0] = map[1];
+
+    assert_null(virtual_malloc(virtual_heap,1024));
+    assert_int_equal(virtual_free(virtual_heap,block1),1);
+}
+
+static void * thread_safe_worker(void * arg){
+    //allocate and free blocks, checking nobody else writes into them
+    uintptr_t id = (uintptr_t) arg;
+    for (int round = 0; round < TEST_ROUNDS; round++){
+        uint8_t * block1 = virtual_malloc(virtual_heap,256 + round % 700);
+        uint8_t * block2 = virtual_malloc(virtual_heap,256);
+        if (block1 == NULL || block2 == NULL){
+            return (void *) 1;
+        }
+        block1[0] = id;
+        block2[0] = id;
+        block2 = virtual_realloc(virtual_heap,block2,1024);
+        if (block2 == NULL || block1[0] != id || block2[0] != id){
+            return (void *) 1;
+        }
+        virtual_free(virtual_heap,block1);
+        virtual_free(virtual_heap,block2);
+    }
+    return NULL;
+}
+
+static void run_threads(void * (* worker)(void *), void * arg){
+    //run a worker on TEST_THREADS threads and check every one succeeded, each gets its id if arg is NULL
+    pthread_t threads[TEST_THREADS];
+    for (uintptr_t i = 0; i < TEST_THREADS; i++){
+        pthread_create(&threads[i],NULL,worker,arg != NULL ? arg : (void *) i);
+    }
+    for (int i = 0; i < TEST_THREADS; i++){
+        void * result;
+        pthread_join(threads[i],&result);
+        assert_null(result);
+    }
+}
+
+static void assert_heap_info(char * filename){
+    //print the heap to a temporary file and compare it to the expected structure
+    freopen("test/out","w",stdout);
+    virtual_info(virtual_heap);
+    freopen("/dev/tty","w",stdout);
+
+    if (compare_heap_info(filename) != 0){
+        fail_msg("heap structure not matched!");
+    }
+}
+
+static void test_virtual_thread_safe_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE);
+    run_threads(thread_safe_worker,NULL);
+
+    //the lock is released and no update of the free size was lost
+    assert_int_equal(((START *) virtual_heap)->lock,0);
+    assert_int_equal(((START *) virtual_heap)->free_size,pow_of_2(NORMAL_HEAP_SIZE));
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_subtree_1(void **state) {
+    init_allocator_subtrees(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_TREE | MODE_SUBTREE_LOCKS, 3);
+    run_threads(thread_safe_worker,NULL);
+    assert_int_equal(((START *) virtual_heap)->heap_held,0);
+    for (int i = 0; i < 8; i++){
+        assert_int_equal(subtree_locks(virtual_heap)[i].lock,0);
+    }
+
+    //every merge crossing a subtree boundary is done once all blocks are freed
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_subtree_2(void **state) {
+    init_allocator_subtrees(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_TREE | MODE_SUBTREE_LOCKS, 1);
+    void * blocks[256];
+
+    //once the subtree of this thread is full, blocks are stolen from the other, until the heap is full
+    for (int i = 0; i < 256; i++){
+        blocks[i] = virtual_malloc(virtual_heap,256);
+        assert_non_null(blocks[i]);
+    }
+    assert_null(virtual_malloc(virtual_heap,256));
+    for (int i = 0; i < 256; i++){
+        assert_int_equal(virtual_free(virtual_heap,blocks[i]),0);
+    }
+
+    //stolen blocks left in a stash are given back by the heap lock
+    for (int i = 0; i < 130; i++){
+        blocks[i] = virtual_malloc(virtual_heap,256);
+    }
+    for (int i = 0; i < 130; i++){
+        virtual_free(virtual_heap,blocks[i]);
+    }
+    assert_true(subtree_locks(virtual_heap)[0].stolen + subtree_locks(virtual_heap)[1].stolen > 0);
+    assert_heap_info("test/test_virtual_init_1");
+    assert_int_equal(subtree_locks(virtual_heap)[0].stolen + subtree_locks(virtual_heap)[1].stolen,0);
+}
+
+static void * free_all_worker(void * arg){
+    //free a batch of blocks allocated by another thread
+    void ** blocks = arg;
+    for (int i = 0; i < 64; i++){
+        if (virtual_free(virtual_heap,blocks[i]) != 0){
+            return (void *) 1;
+        }
+    }
+    return NULL;
+}
+
+static void * double_free_worker(void * arg){
+    //free a block allocated by another thread twice
+    virtual_free(virtual_heap,arg);
+    virtual_free(virtual_heap,arg);
+    return NULL;
+}
+
+static void test_virtual_subtree_3(void **state) {
+    init_allocator_subtrees(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_TREE | MODE_SUBTREE_LOCKS, 2);
+    void * blocks[64];
+
+    //one thread allocates, another frees, the frees of other subtrees wait in their remote free queues
+    for (int round = 0; round < 100; round++){
+        for (int i = 0; i < 64; i++){
+            blocks[i] = virtual_malloc(virtual_heap,256 + (i % 3) * 256);
+            assert_non_null(blocks[i]);
+        }
+        pthread_t thread;
+        void * result;
+        pthread_create(&thread,NULL,free_all_worker,blocks);
+        pthread_join(thread,&result);
+        assert_null(result);
+    }
+
+    //the queues are only emptied when their subtree lock is taken next
+    uint32_t queued = 0;
+    for (int i = 0; i < 4; i++){
+        queued |= subtree_locks(virtual_heap)[i].remote;
+    }
+    assert_true(queued != 0);
+    assert_heap_info("test/test_virtual_init_1");
+    for (int i = 0; i < 4; i++){
+        assert_int_equal(subtree_locks(virtual_heap)[i].remote,0);
+    }
+
+    //a block freed twice by another subtree loops its queue, draining it still ends
+    blocks[0] = virtual_malloc(virtual_heap,256);
+    assert_non_null(blocks[0]);
+    pthread_t thread;
+    pthread_create(&thread,NULL,double_free_worker,blocks[0]);
+    pthread_join(thread,NULL);
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_tcache_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE, MODE_TCACHE);
+    void * block1 = virtual_malloc(virtual_heap,1024);
+    assert_non_null(block1);
+
+    //the bin was refilled with a batch of blocks, a freed block stays cached for this thread
+    assert_int_equal(virtual_free(virtual_heap,block1),0);
+    void * block2 = virtual_malloc(virtual_heap,1000);
+    assert_ptr_equal(block1,block2);
+    virtual_free(virtual_heap,block2);
+
+    //use temporary file to store the output
+    freopen("test/out","w",stdout);
+    virtual_info(virtual_heap);
+    freopen("/dev/tty","w",stdout);
+
+    //cached blocks are still allocated
+    if (compare_heap_info("test/test_virtual_tcache_1") != 0){
+        fail_msg("heap structure not matched!");
+    }
+
+    virtual_tcache_flush(virtual_heap);
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_tcache_2(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE | MODE_TCACHE);
+    run_threads(thread_safe_worker,NULL);
+
+    //the cache of every thread was drained when it exited
+    assert_int_equal(((START *) virtual_heap)->free_size,pow_of_2(NORMAL_HEAP_SIZE));
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_lock_free_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE, MODE_LOCK_FREE);
+    void * block1 = virtual_malloc(virtual_heap,1024);
+    void * block2 = virtual_malloc(virtual_heap,2048);
+    assert_non_null(block1);
+    assert_non_null(block2);
+
+    //freed blocks of the smallest sizes are stacked and popped again
+    assert_int_equal(virtual_free(virtual_heap,block1),0);
+    assert_int_equal(virtual_free(virtual_heap,block2),0);
+    assert_ptr_equal(virtual_malloc(virtual_heap,2000),block2);
+    assert_ptr_equal(virtual_malloc(virtual_heap,1000),block1);
+    virtual_free(virtual_heap,block1);
+    virtual_free(virtual_heap,block2);
+
+    //virtual_info merges the stacked blocks back first
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_lock_free_2(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE | MODE_LOCK_FREE);
+    run_threads(thread_safe_worker,NULL);
+
+    //freed blocks wait in the stacks until virtual_info merges them back
+    uint64_t stacked = 0;
+    for (int i = 0; i < STACK_ORDERS; i++){
+        stacked |= free_stacks(virtual_heap)[i].head & UINT32_MAX;
+    }
+    assert_true(stacked != 0);
+    assert_heap_info("test/test_virtual_init_1");
+    for (int i = 0; i < STACK_ORDERS; i++){
+        assert_int_equal(free_stacks(virtual_heap)[i].head & UINT32_MAX,0);
+    }
+}
+
+static void * free_worker(void * arg){
+    //free a block allocated by another thread
+    return (void *) (uintptr_t) virtual_free(virtual_heap,arg);
+}
+
+static void test_virtual_arenas_1(void **state) {
+    init_allocator_arenas(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE, 3);
+    //the number of arenas is rounded up to a power of 2
+    assert_int_equal(((START *) virtual_heap)->lock_depth,2);
+    assert_true(((START *) virtual_heap)->mode & MODE_PER_CPU);
+
+    run_threads(thread_safe_worker,NULL);
+
+    //a block goes back to its arena from any thread
+    void * block = virtual_malloc(virtual_heap,256);
+    assert_non_null(block);
+    pthread_t thread;
+    void * result;
+    pthread_create(&thread,NULL,free_worker,block);
+    pthread_join(thread,&result);
+    assert_null(result);
+
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_epoch_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE);
+    uint8_t * block1 = virtual_malloc(virtual_heap,256);
+    uint8_t * block2 = virtual_malloc(virtual_heap,1024);
+    assert_non_null(block1);
+    assert_non_null(block2);
+    block1[0] = 1;
+
+    //retired blocks stay readable until every critical section has left the epoch
+    virtual_epoch_enter();
+    assert_int_equal(virtual_retire(virtual_heap,block1),0);
+    assert_int_equal(virtual_retire(virtual_heap,block2),0);
+    assert_int_equal(virtual_retire(virtual_heap,block1 + 1),1);
+    assert_int_equal(virtual_epoch_synchronize(),1);
+    assert_int_equal(block1[0],1);
+    virtual_epoch_exit();
+
+    assert_int_equal(virtual_epoch_synchronize(),0);
+    assert_heap_info("test/test_virtual_init_1");
+
+    //TLSF blocks are checked through their boundary tags
+    init_allocator_tlsf(virtual_heap, NORMAL_HEAP_SIZE, MODE_THREAD_SAFE);
+    block1 = virtual_malloc(virtual_heap,256);
+    assert_non_null(block1);
+    memset(block1,0,256);
+    assert_int_equal(virtual_retire(virtual_heap,block1 + 1),1);
+    assert_int_equal(virtual_retire(virtual_heap,block1 + 64),1);
+    assert_int_equal(virtual_retire(virtual_heap,block1),0);
+    assert_int_equal(virtual_epoch_synchronize(),0);
+    assert_heap_info("test/test_virtual_tlsf_2");
+}
+
+static void * epoch_worker(void * arg){
+    //retire the blocks of a shared slot, reading the slot in critical sections
+    uint8_t ** slot = arg;
+    for (int round = 0; round < TEST_ROUNDS; round++){
+        uint8_t * fresh = virtual_malloc(virtual_heap,256);
+        if (fresh == NULL){
+            virtual_epoch_synchronize();
+            continue;
+        }
+        fresh[0] = 7;
+        virtual_epoch_enter();
+        uint8_t * old = __atomic_exchange_n(slot,fresh,__ATOMIC_ACQ_REL);
+        uint8_t * seen = __atomic_load_n(slot,__ATOMIC_ACQUIRE);
+        if (seen[0] != 7 || (old != NULL && old[0] != 7)){
+            virtual_epoch_exit();
+            return (void *) 1;
+        }
+        virtual_epoch_exit();
+        //retired outside the critical section, a block is freed right away if no bag fits
+        if (old != NULL && virtual_retire(virtual_heap,old) != 0){
+            return (void *) 1;
+        }
+    }
+    return NULL;
+}
+
+static void test_virtual_epoch_2(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE);
+    uint8_t * slot = NULL;
+    run_threads(epoch_worker,&slot);
+
+    //the bags of exited threads are freed as orphans
+    virtual_free(virtual_heap,slot);
+    assert_int_equal(virtual_epoch_synchronize(),0);
+    assert_int_equal(((START *) virtual_heap)->free_size,pow_of_2(NORMAL_HEAP_SIZE));
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_stats_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE, MODE_STATS);
+    STATS stats;
+    void * block = virtual_malloc(virtual_heap,1024);
+    assert_non_null(block);
+
+    //splitting the heap down to 1024 bytes leaves one FREE block of every larger size below it
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.blocks,7);
+    assert_int_equal(stats.used_size,1024);
+    assert_int_equal(stats.free_size,pow_of_2(NORMAL_HEAP_SIZE) - 1024);
+    assert_int_equal(stats.largest,NORMAL_HEAP_SIZE - 1);
+    for (uint8_t size = NORMAL_BLOCK_SIZE; size < NORMAL_HEAP_SIZE; size++){
+        assert_int_equal(stats.free_blocks[size],1);
+    }
+
+    virtual_free(virtual_heap,block);
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.blocks,1);
+    assert_int_equal(stats.used_size,0);
+    assert_int_equal(stats.largest,NORMAL_HEAP_SIZE);
+    assert_int_equal(stats.free_blocks[NORMAL_HEAP_SIZE],1);
+
+    //a heap without MODE_STATS has no counters
+    init_allocator(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE);
+    assert_int_equal(virtual_stats(virtual_heap,&stats),1);
+}
+
+static int stats_running = 0;
+
+static void * stats_monitor(void * arg){
+    //read snapshots while others allocate, every one must add up
+    STATS stats;
+    long snapshots = 0;
+    while (__atomic_load_n(&stats_running,__ATOMIC_ACQUIRE) || snapshots == 0){
+        if (virtual_stats(virtual_heap,&stats) != 0){
+            return (void *) 1;
+        }
+        uint64_t free_size = 0;
+        for (uint8_t size = 0; size < STATS_SIZES; size++){
+            free_size += stats.free_blocks[size] * pow_of_2(size);
+        }
+        if (free_size != stats.free_size || stats.free_size + stats.used_size != pow_of_2(NORMAL_HEAP_SIZE)){
+            return (void *) 1;
+        }
+        snapshots ++;
+    }
+    return NULL;
+}
+
+static void test_virtual_stats_2(void **state) {
+    uint8_t modes[2] = {MODE_THREAD_SAFE | MODE_STATS, MODE_TREE | MODE_SUBTREE_LOCKS | MODE_STATS};
+    for (int m = 0; m < 2; m++){
+        init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, modes[m]);
+        pthread_t monitor;
+        void * result;
+        __atomic_store_n(&stats_running,1,__ATOMIC_RELEASE);
+        pthread_create(&monitor,NULL,stats_monitor,NULL);
+        run_threads(thread_safe_worker,NULL);
+        __atomic_store_n(&stats_running,0,__ATOMIC_RELEASE);
+        pthread_join(monitor,&result);
+        assert_null(result);
+
+        //once the remote free queues are emptied, the counters agree with the heap
+        assert_heap_info("test/test_virtual_init_1");
+        STATS stats;
+        assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+        assert_int_equal(stats.used_size,0);
+        assert_int_equal(stats.free_blocks[NORMAL_HEAP_SIZE],1);
+    }
+}
+
+static void test_virtual_maintenance_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, NORMAL_BLOCK_SIZE, MODE_THREAD_SAFE | MODE_STATS);
+    STATS stats;
+    void * blocks[8];
+    assert_int_equal(virtual_maintenance_start(virtual_heap,1000,0,0),0);
+    assert_int_equal(virtual_maintenance_start(virtual_heap,1000,0,0),1);
+
+    //frees are only queued, the thread waits for 1000 of them
+    for (int i = 0; i < 8; i++){
+        blocks[i] = virtual_malloc(virtual_heap,1024);
+        assert_non_null(blocks[i]);
+    }
+    for (int i = 0; i < 8; i++){
+        assert_int_equal(virtual_free(virtual_heap,blocks[i]),0);
+    }
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.used_size,8 * 1024);
+
+    assert_int_equal(virtual_maintenance_drain(virtual_heap),0);
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.blocks,1);
+    assert_int_equal(stats.used_size,0);
+
+    assert_int_equal(virtual_maintenance_stop(virtual_heap),0);
+    assert_int_equal(virtual_maintenance_stop(virtual_heap),1);
+}
+
+static void test_virtual_maintenance_2(void **state) {
+    uint8_t modes[3] = {MODE_THREAD_SAFE, MODE_TREE | MODE_SUBTREE_LOCKS, MODE_THREAD_SAFE | MODE_LOCK_FREE};
+    for (int m = 0; m < 3; m++){
+        //woken every 16 frees or every millisecond, and trimming FREE blocks of a page or more
+        init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, modes[m]);
+        assert_int_equal(virtual_maintenance_start(virtual_heap,16,1,12),0);
+        run_threads(thread_safe_worker,NULL);
+        assert_int_equal(virtual_maintenance_stop(virtual_heap),0);
+
+        //stopping drains the deferred queue
+        assert_int_equal(((START *) virtual_heap)->pending,0);
+        assert_int_equal(((START *) virtual_heap)->deferred,0);
+        assert_int_equal(((START *) virtual_heap)->wake_batch,0);
+
+        assert_heap_info("test/test_virtual_init_1");
+    }
+}
+
+static void test_virtual_slab_1(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_STATS);
+    STATS stats;
+    uint8_t * nodes[8];
+    assert_int_equal(virtual_slab_enable(virtual_heap),0);
+    assert_int_equal(virtual_slab_enable(virtual_heap),1);
+
+    //24 byte nodes take 32 bytes, 7 of them fit a 256 byte slab after its header
+    for (int i = 0; i < 8; i++){
+        nodes[i] = virtual_malloc(virtual_heap,24);
+        assert_non_null(nodes[i]);
+        memset(nodes[i],i,24);
+    }
+    for (int i = 1; i < 7; i++){
+        assert_ptr_equal(nodes[i],nodes[0] + i * 32);
+    }
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.used_size,3 * 256);
+
+    //an object is only freed once, and only from its start
+    assert_int_equal(virtual_free(virtual_heap,nodes[1] + 8),1);
+    assert_int_equal(virtual_free(virtual_heap,nodes[1]),0);
+    assert_int_equal(virtual_free(virtual_heap,nodes[1]),1);
+
+    //growing past the largest class moves the object to a block
+    nodes[2] = virtual_realloc(virtual_heap,nodes[2],100);
+    assert_non_null(nodes[2]);
+    assert_int_equal(nodes[2][23],2);
+    assert_int_equal(virtual_free(virtual_heap,nodes[2]),0);
+
+    //a batch frees nothing if one pointer is not allocated, its objects are sorted in front of its blocks
+    void * block = virtual_malloc(virtual_heap,300);
+    assert_non_null(block);
+    void * batch[8] = {nodes[7], nodes[0], block, nodes[3], nodes[4], nodes[5], nodes[6], nodes[1]};
+    assert_int_equal(virtual_free_batch(virtual_heap,batch,8),1);
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.used_size,3 * 256 + 512);
+    for (int i = 1; i < 7; i++){
+        assert_true(batch[i - 1] < batch[i]);
+    }
+    assert_ptr_equal(batch[7],block);
+
+    //empty slabs go back, only the directory is left, and every entry is cleared
+    void * valid[7] = {nodes[7], nodes[0], block, nodes[3], nodes[4], nodes[5], nodes[6]};
+    assert_int_equal(virtual_free_batch(virtual_heap,valid,7),0);
+    for (int i = 0; i < 7; i++){
+        assert_null(valid[i]);
+    }
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.used_size,256);
+
+    //blocks of 32 bytes have no room for a slab
+    init_allocator(virtual_heap, SMALL_HEAP_SIZE, 5);
+    assert_int_equal(virtual_slab_enable(virtual_heap),1);
+}
+
+static void * slab_worker(void * arg){
+    //allocate and free small objects, checking nobody else writes into them
+    uintptr_t id = (uintptr_t) arg;
+    uint8_t * objects[16];
+    for (int round = 0; round < TEST_ROUNDS; round++){
+        for (int i = 0; i < 16; i++){
+            objects[i] = virtual_malloc(virtual_heap,1 + (round + i) % 64);
+            if (objects[i] == NULL){
+                return (void *) 1;
+            }
+            objects[i][0] = id;
+        }
+        objects[0] = virtual_realloc(virtual_heap,objects[0],200);
+        for (int i = 0; i < 16; i++){
+            if (objects[i] == NULL || objects[i][0] != id || virtual_free(virtual_heap,objects[i]) != 0){
+                return (void *) 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void test_virtual_slab_2(void **state) {
+    uint8_t modes[2] = {MODE_THREAD_SAFE | MODE_STATS, MODE_TREE | MODE_SUBTREE_LOCKS | MODE_STATS};
+    for (int m = 0; m < 2; m++){
+        init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, modes[m]);
+        assert_int_equal(virtual_slab_enable(virtual_heap),0);
+        run_threads(slab_worker,NULL);
+
+        //virtual_info gives back the blocks waiting in remote free queues, then only the slab directory is left
+        freopen("test/out","w",stdout);
+        virtual_info(virtual_heap);
+        freopen("/dev/tty","w",stdout);
+        STATS stats;
+        assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+        assert_int_equal(stats.used_size,256);
+    }
+}
+
+static void test_virtual_tlsf_1(void **state) {
+    init_allocator_tlsf(virtual_heap, NORMAL_HEAP_SIZE, MODE_PARANOID);
+    //1025 bytes take a block of 1040 with its header, not 2048
+    uint8_t * block1 = virtual_malloc(virtual_heap,1025);
+    uint8_t * block2 = virtual_malloc(virtual_heap,1024);
+    uint8_t * block3 = virtual_malloc(virtual_heap,2048);
+    uint8_t * block4 = virtual_malloc(virtual_heap,100);
+    assert_non_null(block1);
+    assert_non_null(block2);
+    assert_non_null(block3);
+    assert_non_null(block4);
+    assert_ptr_equal(block2,block1 + 1040);
+
+    //freeing the first two blocks merges them, and the last one grows in place into the FREE space after it
+    block4[99] = 4;
+    assert_int_equal(virtual_free(virtual_heap,block2),0);
+    assert_int_equal(virtual_free(virtual_heap,block1),0);
+    assert_int_equal(virtual_free(virtual_heap,block1),1);
+    assert_ptr_equal(virtual_realloc(virtual_heap,block4,1000),block4);
+    assert_int_equal(block4[99],4);
+
+    assert_heap_info("test/test_virtual_tlsf_1");
+
+    //everything merges back into one block
+    assert_int_equal(virtual_free(virtual_heap,block3),0);
+    assert_int_equal(virtual_free(virtual_heap,block4),0);
+    assert_non_null(virtual_malloc(virtual_heap,pow_of_2(NORMAL_HEAP_SIZE) - 2 * TLSF_HEADER));
+}
+
+static void test_virtual_tlsf_2(void **state) {
+    init_allocator_tlsf(virtual_heap, NORMAL_HEAP_SIZE, MODE_THREAD_SAFE);
+    run_threads(thread_safe_worker,NULL);
+
+    //every free merged with its neighbours through the boundary tags, back into one block
+    assert_heap_info("test/test_virtual_tlsf_2");
+    assert_non_null(virtual_malloc(virtual_heap,pow_of_2(NORMAL_HEAP_SIZE) - 2 * TLSF_HEADER));
+}
+
+static void test_virtual_weighted_1(void **state) {
+    init_allocator_weighted(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_PARANOID);
+    //1500 and 700 bytes take weighted blocks of 1536 and 768, not 2048 and 1024
+    uint8_t * block1 = virtual_malloc(virtual_heap,1500);
+    uint8_t * block2 = virtual_malloc(virtual_heap,700);
+    uint8_t * block3 = virtual_malloc(virtual_heap,300);
+    assert_non_null(block1);
+    assert_ptr_equal(block3,block1 + 1536);
+    assert_ptr_equal(block2,block1 + 2048);
+
+    //shrinking gives back the last third in place, growing past two thirds moves the block
+    block1[999] = 1;
+    block2[699] = 2;
+    assert_ptr_equal(virtual_realloc(virtual_heap,block1,1000),block1);
+    block2 = virtual_realloc(virtual_heap,block2,1000);
+    assert_ptr_equal(block2,block1 + 3072);
+    assert_int_equal(block1[999],1);
+    assert_int_equal(block2[699],2);
+
+    assert_heap_info("test/test_virtual_weighted_1");
+
+    //everything merges back into one block
+    assert_int_equal(virtual_free(virtual_heap,block1),0);
+    assert_int_equal(virtual_free(virtual_heap,block2),0);
+    assert_int_equal(virtual_free(virtual_heap,block3),0);
+    assert_non_null(virtual_malloc(virtual_heap,pow_of_2(NORMAL_HEAP_SIZE)));
+}
+
+static void test_virtual_weighted_2(void **state) {
+    init_allocator_weighted(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE | MODE_STATS);
+    STATS stats;
+    uint32_t sizes[3] = {1500, 700, 300};
+    void * blocks[3];
+    assert_int_equal(virtual_malloc_batch(virtual_heap,sizes,blocks,3),0);
+    assert_int_equal(virtual_stats(virtual_heap,&stats),0);
+    assert_int_equal(stats.used_size,1536 + 768 + 512);
+    assert_int_equal(virtual_free_batch(virtual_heap,blocks,3),0);
+
+    run_threads(thread_safe_worker,NULL);
+
+    assert_heap_info("test/test_virtual_weighted_2");
+
+    //the per-thread modes are not available to the weighted engine, the heap is left as it was
+    init_allocator_weighted(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE | MODE_TCACHE);
+    assert_int_equal(((START *) virtual_heap)->mode,MODE_THREAD_SAFE | MODE_STATS);
+}
+
+static void test_virtual_region_1(void **state) {
+    init_allocator(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE);
+    REGION * region = virtual_region_create(virtual_heap,NORMAL_BLOCK_SIZE);
+    assert_non_null(region);
+
+    //objects follow each other in the first chunk, rounded up to their alignment
+    BYTE * object1 = virtual_region_alloc(region,10,0);
+    BYTE * object2 = virtual_region_alloc(region,1,64);
+    assert_ptr_equal(object1,(BYTE *) (region + 1));
+    assert_int_equal((uintptr_t) object2 % 64,0);
+
+    //a request larger than a chunk gets one of its own, the first chunk still serves the others
+    BYTE * object3 = virtual_region_alloc(region,2000,0);
+    BYTE * object4 = virtual_region_alloc(region,8,0);
+    assert_ptr_equal(object3,(BYTE *) region + 2048 + sizeof(void *));
+    assert_ptr_equal(object4,object2 + REGION_ALIGN);
+    assert_ptr_equal(region->prev,object3 - sizeof(void *));
+
+    //once the first chunk is full, the next one is chained
+    assert_non_null(virtual_region_alloc(region,900,0));
+    BYTE * object5 = virtual_region_alloc(region,100,0);
+    assert_ptr_equal(object5,(BYTE *) region + 1024 + sizeof(void *));
+    memset(object3,3,2000);
+    memset(object5,5,100);
+
+    //destroying the region frees every chunk
+    assert_int_equal(virtual_region_destroy(region),0);
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_region_2(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_TREE | MODE_THREAD_SAFE);
+    //a chunk must hold the region, and the alignment must be a power of 2
+    assert_null(virtual_region_create(virtual_heap,4));
+    REGION * region = virtual_region_create(virtual_heap,SMALL_BLOCK_SIZE);
+    assert_non_null(region);
+    assert_null(virtual_region_alloc(region,8,3));
+    assert_null(virtual_region_alloc(region,0,0));
+
+    //objects of many chunks keep their contents until the region is destroyed
+    uint32_t * objects[400];
+    for (uint32_t i = 0; i < 400; i++){
+        objects[i] = virtual_region_alloc(region,40,16);
+        assert_non_null(objects[i]);
+        assert_int_equal((uintptr_t) objects[i] % 16,0);
+        objects[i][0] = i;
+        objects[i][9] = i;
+    }
+    for (uint32_t i = 0; i < 400; i++){
+        assert_int_equal(objects[i][0],i);
+        assert_int_equal(objects[i][9],i);
+    }
+
+    //a request the heap cannot hold fails, and the region is still usable
+    assert_null(virtual_region_alloc(region,pow_of_2(NORMAL_HEAP_SIZE),0));
+    assert_non_null(virtual_region_alloc(region,40,0));
+
+    assert_int_equal(virtual_region_destroy(region),0);
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void test_virtual_pool_1(void **state) {
+    init_allocator(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE);
+    POOL_STATS stats;
+    //24 byte objects, 10 of them need a block of 512, which holds 19
+    POOL * pool = virtual_pool_create(virtual_heap,24,10);
+    assert_non_null(pool);
+    BYTE * objects[20];
+    for (int i = 0; i < 20; i++){
+        objects[i] = virtual_pool_alloc(pool);
+        assert_non_null(objects[i]);
+    }
+    assert_ptr_equal(objects[1],objects[0] + 24);
+    assert_int_equal(virtual_pool_stats(pool,&stats),0);
+    assert_int_equal(stats.per_chunk,19);
+    assert_int_equal(stats.chunks,2);
+    assert_int_equal(stats.capacity,38);
+    assert_int_equal(stats.used,20);
+
+    //a freed object is the next one allocated, and an empty chunk goes back to the heap
+    assert_int_equal(virtual_pool_free(pool,objects[3]),0);
+    assert_ptr_equal(virtual_pool_alloc(pool),objects[3]);
+    assert_int_equal(virtual_pool_free(pool,objects[19]),0);
+    assert_int_equal(virtual_pool_stats(pool,&stats),0);
+    assert_int_equal(stats.chunks,1);
+    assert_int_equal(stats.used,19);
+
+    //only allocated objects of the pool can be freed
+    void * block = virtual_malloc(virtual_heap,24);
+    assert_int_equal(virtual_pool_free(pool,objects[0] + 1),1);
+    assert_int_equal(virtual_pool_free(pool,objects[19]),1);
+    assert_int_equal(virtual_pool_free(pool,block),1);
+    virtual_free(virtual_heap,block);
+
+    //an object freed twice in a chunk still in use is rejected, the chunk keeps its objects
+    assert_int_equal(virtual_pool_free(pool,objects[5]),0);
+    assert_int_equal(virtual_pool_free(pool,objects[5]),1);
+    assert_int_equal(virtual_pool_stats(pool,&stats),0);
+    assert_int_equal(stats.chunks,1);
+    assert_int_equal(stats.used,18);
+    assert_ptr_equal(virtual_pool_alloc(pool),objects[5]);
+
+    for (int i = 0; i < 19; i++){
+        assert_int_equal(virtual_pool_free(pool,objects[i]),0);
+    }
+    assert_int_equal(virtual_pool_stats(pool,&stats),0);
+    assert_int_equal(stats.chunks,0);
+    assert_int_equal(virtual_pool_destroy(pool),0);
+    assert_heap_info("test/test_virtual_init_1");
+}
+
+static void * pool_worker(void * arg){
+    //allocate and free objects of a shared pool, checking nobody else writes into them
+    POOL * pool = arg;
+    uint64_t id = (uint64_t) pthread_self();
+    uint64_t * objects[50];
+    for (int round = 0; round < TEST_ROUNDS / 10; round++){
+        for (int i = 0; i < 50; i++){
+            objects[i] = virtual_pool_alloc(pool);
+            if (objects[i] == NULL){
+                return (void *) 1;
+            }
+            objects[i][0] = id;
+            objects[i][4] = id + i;
+        }
+        for (int i = 0; i < 50; i++){
+            if (objects[i][0] != id || objects[i][4] != id + i || virtual_pool_free(pool,objects[i]) != 0){
+                return (void *) 1;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void test_virtual_pool_2(void **state) {
+    init_allocator_mode(virtual_heap, NORMAL_HEAP_SIZE, SMALL_BLOCK_SIZE, MODE_THREAD_SAFE);
+    POOL * pool = virtual_pool_create(virtual_heap,40,16);
+    assert_non_null(pool);
+    run_threads(pool_worker,pool);
+    POOL_STATS stats;
+    assert_int_equal(virtual_pool_stats(pool,&stats),0);
+    assert_int_equal(stats.used,0);
+    assert_int_equal(stats.chunks,0);
+
+    //objects still allocated go back with their chunks
+    assert_non_null(virtual_pool_alloc(pool));
+    assert_int_equal(virtual_pool_destroy(pool),0);
+    assert_heap_info("test/test_virtual_init_1");
+
+    //chunks of the TLSF engine are not aligned to their size
+    init_allocator_tlsf(virtual_heap, NORMAL_HEAP_SIZE, 0);
+    assert_null(virtual_pool_create(virtual_heap,40,16));
+}
+
 int main() {
     /*
      * Constructing Unit Test
@@ -350,12 +1256,43 @@ int main() {
             cmocka_unit_test_setup_teardown(test_virtual_malloc_1,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_malloc_2,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_malloc_3,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_malloc_batch_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_malloc_batch_2,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_free_1,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_free_2,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_free_3,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_free_batch_1,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_realloc_1,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_realloc_2,setup_virtual_heap,erase_virtual_heap),
             cmocka_unit_test_setup_teardown(test_virtual_realloc_3,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_realloc_4,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_tree_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_paranoid_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_thread_safe_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_subtree_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_subtree_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_subtree_3,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_tcache_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_tcache_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_lock_free_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_lock_free_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_arenas_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_epoch_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_epoch_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_stats_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_stats_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_maintenance_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_maintenance_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_slab_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_slab_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_tlsf_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_tlsf_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_weighted_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_weighted_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_region_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_region_2,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_pool_1,setup_virtual_heap,erase_virtual_heap),
+            cmocka_unit_test_setup_teardown(test_virtual_pool_2,setup_virtual_heap,erase_virtual_heap),
     };
 
     /*
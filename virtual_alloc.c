@@ -1,16 +1,27 @@
+#define _GNU_SOURCE
 #include "virtual_alloc.h"
 #include "virtual_sbrk.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 /*
  * Buddy Data Structure: HEADER
  * Size of HEADER: 1 byte
  *
  * Bits:  0   1   2   3   4   5   6   7
  *      | 0 | 0 | 0 | 0 | 0 | 0 | 0 | 0 |
- *   |Status|Padding|       Size        |
+ *   |Status|Weight|        Size        |
  *
  * Status: FREE 0
  *         IN USE 1
  *
+ * Weight: 0 for a block of 2^(size)
+ *         1 (WEIGHTED) for a block of 3 * 2^(size), only IN_USE blocks of ENGINE_WEIGHTED heaps
+ *
  * Size: 2^(size)
  *
  */
@@ -20,491 +31,3880 @@ uint8_t read_status(HEADER h){
     return h >> 7;
 }
 
+uint8_t read_weight(HEADER h){
+    // read if a block in the buddy data structure is a weighted block of 3 * 2^(size)
+    return (h & WEIGHTED) != 0;
+}
+
 uint8_t read_size(HEADER h){
     // read the size of a block in the buddy data structure
-    h = h << 1;
-    return h >> 1;
+    h = h << 2;
+    return h >> 2;
+}
+
+uint64_t block_bytes(HEADER h){
+    // read the number of bytes of a block in the buddy data structure
+    return read_weight(h) ? 3 * pow_of_2(read_size(h)) : pow_of_2(read_size(h));
 }
 
 /*
  * Virtual Heap Structure
  * Byte offset:
- * |    0    |    1    | ... 2^(init_size)... | 2^(init_size) + 2| ..... |
- * |init size| min size|   Allocating space   | Allocator Data Structure |
- * |                                                                     |
- * heapstart                                             virtual program break
+ * |  0 ... 63  | ... 2^(init_size)... | 2^(init_size) + 64 ... |  .....  |  .....  |
+ * | heap start |   Allocating space   |   Free Block Index     |Block Map|  Locks  |
+ * |                                                                               |
+ * heapstart                                                      virtual program break
+ *
+ * Heap start: START, see virtual_alloc.h
+ * Mode: MODE_BITMAP or MODE_TREE, the engine used by the free block index
+ *       with MODE_PARANOID, every call walks the whole block map before doing anything
+ *       with MODE_THREAD_SAFE, every call holds the heap lock in heap start
+ *       with MODE_SUBTREE_LOCKS (tree engine only), every subtree at lock depth has its own lock
+ *       with MODE_TCACHE, every thread keeps a cache of small blocks, see Thread Cache
+ *       with MODE_LOCK_FREE, the smallest sizes have lock-free free stacks, see Free Stacks
+ *       with MODE_PER_CPU (subtree locks only), the subtrees are arenas chosen by CPU
+ *       with MODE_STATS, counters of FREE blocks by size are kept for virtual_stats
+ * Locks: the subtree locks with MODE_SUBTREE_LOCKS, see Subtree Locks,
+ *        then the free stacks with MODE_LOCK_FREE,
+ *        then the statistics counters with MODE_STATS, see Statistics
  *
  */
 
 uint8_t read_init_size(START *s){
     // read the initial size of the virtual heap in heap start
-    return (*s);
+    return s->init_size;
 }
 
 uint8_t read_min_size(START *s){
     // read the minimum size of the virtual heap in heap start
-    return (*(s+1));
+    return s->min_size;
 }
 
-void writer_status(HEADER *h, uint8_t status){
-    // Update the status of a block's buddy data structure
-    uint8_t size = read_size(*h);
-    (*h) = (status << 7) | size;
+uint8_t read_lock_depth(START *s){
+    // read the depth of the subtrees with their own lock, 0 if the heap has none
+    return s->lock_depth;
 }
 
-void writer_size(HEADER *h, uint8_t size){
-    // Update the size of a block's buddy data structure
-    uint8_t status = read_status(*h);
-    (*h) = (status << 7) | size;
+uint8_t read_engine(START *s){
+    // read the engine of the virtual heap in heap start
+    return s->engine;
 }
 
-void write_start(START *s, uint8_t init_size, uint8_t min_size){
-    //Update the data stores in the heap start
-    (*s) = init_size;
-    (*(s+1)) = min_size;
+uint8_t read_mode(START *s){
+    // read the mode of the virtual heap in heap start
+#ifdef VIRTUAL_PARANOID
+    return s->mode | MODE_PARANOID;
+#else
+    return s->mode;
+#endif
 }
 
-HEADER * add_block(HEADER *h){
-    /*
-     * Add a new block after the given block
-     * With pushing all blocks behind with 1 byte
-     * And moving program break behind for 1 byte
-     * Before:
-     *  .... | Header h | Next | Next Next | .... |
-     *                                      program break
-     * After:
-     *  .... | Header h | New | Next | Next Next | .... |
-     *                                        new program break
-     */
-    if (virtual_sbrk(HEADER_SIZE) == NULL){
-        return NULL;
-    }
-    HEADER * dest = h + 2 * HEADER_SIZE;
-    HEADER * new_block = h + HEADER_SIZE;
-    uint64_t size = virtual_sbrk(0) - (void *)new_block;
-    memmove(dest,new_block,size);
-    *new_block = 0;
-    return new_block;
+/*
+ * Free Block Index: INDEX
+ * Stored (8 byte aligned) right after the allocating space
+ *
+ * |  words  | ..... engine data ..... |
+ *
+ * Words: the total number of words of the index, the Allocator Data Structure follows it
+ *
+ * Both engines answer the same question: the FREE block with the smallest size
+ * which is large enough, and the lowest address among blocks of that size,
+ * so the two engines always place blocks at the same address.
+ */
+
+INDEX * free_index(void * heapstart){
+    //compute the address of the free block index, aligned to a word after the allocating space
+    uintptr_t address = (uintptr_t)(heapstart + HEAPSTART_SIZE + pow_of_2(read_init_size(heapstart)));
+    address = (address + sizeof(INDEX) - 1) & ~(uintptr_t)(sizeof(INDEX) - 1);
+    return (INDEX *) address;
 }
 
-HEADER * remove_block(HEADER *h){
-    /*
-     * Remove the block given
-     * With pushing all blocks forward with 1 byte
-     * And moving program break forward for 1 byte
-     * Before:
-     *  .... | Header h | Next | Next Next | .... |
-     *                                      program break
-     * After:
-     *  .... | Next | Next Next | .... |
-     *                           new program break
-     */
-    HEADER * src = h + HEADER_SIZE;
-    uint64_t size = virtual_sbrk(0) - (void *)h;
-    memmove(h,src,size);
+HEADER * block_map(void * heapstart){
+    //Compute the address of the block map, which is right after the free block index
+    INDEX * index = free_index(heapstart);
+    return (HEADER *) (index + index[0]);
+}
 
-    if (virtual_sbrk(-1) == NULL){
-        return NULL;
+/*
+ * Subtree Locks
+ * Used only by heaps initialized with MODE_SUBTREE_LOCKS, stored (cache line aligned) after the block map
+ *
+ * | lock of subtree 0 | lock of subtree 1 | ... | lock of subtree 2^(lock_depth) - 1 |
+ *
+ * Subtree i is the block of size init_size - lock_depth with serial i, node 2^(lock_depth) + i
+ * of the tree engine. Its lock covers its block map entries and its nodes.
+ * Blocks of at least the subtree size, and merges crossing a subtree boundary,
+ * are handled with every subtree lock held, taken in order, which is also the heap lock
+ * A thread holds one subtree lock at a time, or all of them, so locking never deadlocks.
+ *
+ * A free inside a subtree merges up to the whole subtree only. The merges crossing
+ * a subtree boundary are done when the heap lock is taken next, before anything else,
+ * so a subtree emptied and refilled by the same thread never takes the heap lock.
+ *
+ * A thread allocates from the subtree picked by a hash of its thread id, or with MODE_PER_CPU
+ * from the subtree of the CPU it runs on, so every subtree is the arena of one CPU.
+ * A block is freed into the subtree holding its address, from any thread.
+ *
+ * A subtree without a fitting FREE block steals a batch of up to STEAL_BATCH blocks from the
+ * sibling with the most FREE space, holding only the lock of the sibling. The blocks are
+ * IN_USE from then on, and those not returned right away wait in the stash of the thief,
+ * taken with its own lock, for the next allocations of their size there. The heap lock gives
+ * stashed blocks back, so running out of one subtree never loses the space of the others.
+ *
+ * A thread freeing a block of another subtree only pushes it onto the remote free queue of that
+ * subtree, with one compare and swap and no lock. The block stays IN_USE, holding the link to
+ * the block pushed before it in its first 4 bytes, until a thread of the subtree takes the whole
+ * queue at once on its next allocation and frees the blocks holding the lock it holds anyway.
+ * The heap lock frees the blocks of every queue as well.
+ */
+
+LOCK * subtree_locks(void * heapstart){
+    //compute the address of the subtree locks, aligned to a cache line after the block map
+    uintptr_t address = (uintptr_t) (block_map(heapstart) + pow_of_2(read_init_size(heapstart) - read_min_size(heapstart)) * HEADER_SIZE);
+    address = (address + LOCK_SIZE - 1) & ~(uintptr_t)(LOCK_SIZE - 1);
+    return (LOCK *) address;
+}
+
+STACK * free_stacks(void * heapstart){
+    //compute the address of the free stacks, aligned to a cache line after the subtree locks or the block map
+    uintptr_t address = (uintptr_t) (block_map(heapstart) + pow_of_2(read_init_size(heapstart) - read_min_size(heapstart)) * HEADER_SIZE);
+    if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+        address = (uintptr_t) (subtree_locks(heapstart) + pow_of_2(read_lock_depth(heapstart)));
     }
-    return h;
+    address = (address + LOCK_SIZE - 1) & ~(uintptr_t)(LOCK_SIZE - 1);
+    return (STACK *) address;
 }
 
-int64_t count_serial(void * heapstart, HEADER * h){
-    /*
-     * Counting the serial in a block
-     * By the sum of size of all blocks behind it / its size
-     * Use to determining where is its buddy
-     * merging left ? or merging right ?
-     * Serial examples:
-     *      0        1         1
-     * |size a-1|size a-1|   size a   |
-     *
-     *         0         2        3
-     * |   size a   |size a-1|size a-1|
-     */
-    HEADER * header_ptr = heapstart + pow_of_2(read_init_size(heapstart)) + HEAPSTART_SIZE;
-    uint64_t blocks = virtual_sbrk(0) - (void *)header_ptr;
-    uint64_t counter = 0;
-    uint64_t serial = 0;
-    while (counter < blocks){
-        if (header_ptr == h){
-            //If we get to the block needed, return its serial
-            serial = serial / pow_of_2(read_size(*h));
-            return serial;
-        }
-        serial += pow_of_2(read_size(*header_ptr));
-        header_ptr += HEADER_SIZE;
-        counter ++;
+uint64_t subtree_count(void * heapstart){
+    //number of subtrees with their own lock
+    return pow_of_2(read_lock_depth(heapstart));
+}
+
+COUNTERS * stats_counters(void * heapstart){
+    //compute the address of the statistics counters, aligned to a cache line after everything else
+    uintptr_t address = (uintptr_t) (block_map(heapstart) + pow_of_2(read_init_size(heapstart) - read_min_size(heapstart)) * HEADER_SIZE);
+    if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+        address = (uintptr_t) (subtree_locks(heapstart) + subtree_count(heapstart));
     }
-    return -1;
+    if (read_mode(heapstart) & MODE_LOCK_FREE){
+        address = (uintptr_t) (free_stacks(heapstart) + STACK_ORDERS);
+    }
+    address = (address + LOCK_SIZE - 1) & ~(uintptr_t)(LOCK_SIZE - 1);
+    return (COUNTERS *) address;
 }
 
-int validation(void * heapstart){
+uint8_t subtree_size(void * heapstart){
+    //size of the block of a subtree
+    return read_init_size(heapstart) - read_lock_depth(heapstart);
+}
+
+uint64_t subtree_of(void * heapstart, BYTE * address){
+    //the subtree holding the given address in allocating space
+    return (address - (BYTE *) (heapstart + HEAPSTART_SIZE)) >> subtree_size(heapstart);
+}
+
+/*
+ * Bitmap Engine (MODE_BITMAP)
+ * One hierarchical bitmap per size
+ *
+ * | words | size table | bitmaps of min size | bitmaps of min size + 1 | ... | bitmaps of init size |
+ *
+ * Size table: word offset of the bitmaps of each size
+ *
+ * Bit n of the bottom level of size k is set when the block with serial n,
+ * which starts at 2^k * n in the allocating space, is FREE and has size k.
+ * Each upper level keeps one bit for every word of the level below,
+ * set when that word is non-zero, so the lowest FREE block of a size
+ * is found by reading one word per level.
+ */
+
+uint64_t bitmap_words(uint64_t bits){
+    //compute the number of words used by the bitmap levels of a size
+    uint64_t words = 0;
+    do {
+        bits = (bits + INDEX_BITS - 1) / INDEX_BITS;
+        words += bits;
+    } while (bits > 1);
+    return words;
+}
+
+int bitmap_levels(void * heapstart, uint8_t size, INDEX ** levels){
     /*
-     * Check if the allocating data structure is valid
-     * If some unexpected behavior happened, or data structure modification detected
-     * it will report an error
+     * Find the bitmap levels of the given size, from the bottom level to the top level
+     * Return the number of levels
      */
-    if(heapstart==NULL){
-        return -1;
-    }
-    //check if initial size and minimum size valid
-    if (read_init_size(heapstart) > 64 || read_min_size(heapstart) > 64){
-        return -1;
-    }
-    if (read_init_size(heapstart) < read_min_size(heapstart)){
-        return -1;
-    }
+    INDEX * index = free_index(heapstart);
+    INDEX * bitmap = index + index[1 + size - read_min_size(heapstart)];
+    uint64_t bits = pow_of_2(read_init_size(heapstart) - size);
+    int count = 0;
+    do {
+        bits = (bits + INDEX_BITS - 1) / INDEX_BITS;
+        levels[count] = bitmap;
+        bitmap += bits;
+        count ++;
+    } while (bits > 1);
+    return count;
+}
 
-    //check if virtual_sbrk working
-    if (virtual_sbrk(0) == NULL){
-        return -1;
+void bitmap_insert(void * heapstart, uint8_t size, uint64_t serial){
+    //mark the block with given size and serial as FREE in the bitmaps
+    INDEX * levels[INDEX_LEVELS];
+    int count = bitmap_levels(heapstart, size, levels);
+    for (int i = 0; i < count; i++){
+        INDEX * word = levels[i] + serial / INDEX_BITS;
+        INDEX before = *word;
+        *word |= (INDEX) 1 << (serial % INDEX_BITS);
+        if (before != 0){
+            //upper levels already know this word is non-zero
+            return;
+        }
+        serial /= INDEX_BITS;
     }
+}
 
-    //Compute the address of the header of first block
-    HEADER * header_ptr = heapstart + pow_of_2(read_init_size(heapstart)) + HEAPSTART_SIZE;
-    //compute the address of each block in allocating space
-    uint64_t blocks = virtual_sbrk(0) - (void *)header_ptr;
-    uint64_t counter = 0;
-    uint64_t sum_size = 0;
-
-    while (counter < blocks){
+void bitmap_remove(void * heapstart, uint8_t size, uint64_t serial){
+    //remove the block with given size and serial from the bitmaps, removing a missing block does nothing
+    INDEX * levels[INDEX_LEVELS];
+    int count = bitmap_levels(heapstart, size, levels);
+    for (int i = 0; i < count; i++){
+        INDEX * word = levels[i] + serial / INDEX_BITS;
+        *word &= ~((INDEX) 1 << (serial % INDEX_BITS));
+        if (*word != 0){
+            //upper levels still need to know this word is non-zero
+            return;
+        }
+        serial /= INDEX_BITS;
+    }
+}
 
-        if(read_size(*header_ptr)>64){
+int64_t bitmap_first(void * heapstart, uint8_t size){
+    //find the serial of the FREE block with given size that has the lowest address, -1 if there is none
+    INDEX * levels[INDEX_LEVELS];
+    int count = bitmap_levels(heapstart, size, levels);
+    uint64_t serial = 0;
+    for (int i = count - 1; i >= 0; i--){
+        INDEX word = levels[i][serial];
+        if (word == 0){
             return -1;
         }
-
-        sum_size += pow_of_2(read_size(*header_ptr));
-        header_ptr += HEADER_SIZE;
-        counter ++;
+        serial = serial * INDEX_BITS + __builtin_ctzll(word);
     }
+    return serial;
+}
 
-    //check if block structure valid
-    if (pow_of_2(read_init_size(heapstart)) != sum_size){
-        return -1;
+int64_t bitmap_best(void * heapstart, uint8_t * size){
+    //try each size from the given one upwards, until a FREE block is found
+    while (*size <= read_init_size(heapstart)){
+        int64_t serial = bitmap_first(heapstart, *size);
+        if (serial >= 0){
+            return serial;
+        }
+        (*size) ++;
     }
+    return -1;
+}
 
-    return 0;
+/*
+ * Tree Engine (MODE_TREE)
+ * A complete binary tree with one node for every possible block
+ *
+ * | words | node 1 | node 2 | node 3 | ... | node 2^(init_size - min_size + 1) - 1 |
+ *
+ * Node 1 is the block of init size, node n has children 2n and 2n + 1,
+ * so the block with size k and serial s is node 2^(init_size - k) + s.
+ *
+ * Each node is a TREE_NODE holding one bit for every size (counted from min size)
+ * of which a FREE block exists in its subtree. The largest FREE size of a subtree
+ * is its highest bit, and following the bit of the best fitting size down from
+ * the root, left child first, reaches the lowest FREE block of that size.
+ *
+ * With MODE_SUBTREE_LOCKS, the nodes of a subtree are only written under its lock.
+ * The nodes above lock depth are shared by every subtree, so they are left behind
+ * by the subtree paths, rebuilt when the heap lock is taken and kept up to date while it is held.
+ */
+
+TREE_NODE * tree_nodes(void * heapstart){
+    //nodes are counted from 1, the word holding the size of the index is in front of them
+    return (TREE_NODE *) (free_index(heapstart) + 1) - 1;
 }
 
-void init_allocator(void * heapstart, uint8_t initial_size, uint8_t min_size) {
+uint64_t tree_words(uint8_t init_size, uint8_t min_size){
+    //compute the number of words used by the nodes
+    uint64_t nodes = pow_of_2(init_size - min_size + 1);
+    return (nodes * sizeof(TREE_NODE) + sizeof(INDEX) - 1) / sizeof(INDEX);
+}
 
-    if(heapstart==NULL){
-        return;
-    }
-    //calculate current space and extend the program break
-    uint64_t current_size = virtual_sbrk(0)-heapstart;
+void node_store(TREE_NODE * nodes, uint64_t node, TREE_NODE value){
+    //the root of a subtree is read by other threads without its lock, so it is stored atomically
+    __atomic_store_n(&nodes[node], value, __ATOMIC_RELAXED);
+}
 
-    if (virtual_sbrk(pow_of_2(initial_size) - current_size + HEAPSTART_SIZE) == NULL){
-        return;
+uint64_t tree_shared(void * heapstart){
+    //nodes below the returned one are above lock depth, they are only kept up to date with the heap lock held
+    START * start = heapstart;
+    if (start->heap_held){
+        return 1;
     }
+    return pow_of_2(read_lock_depth(heapstart));
+}
 
-    HEADER * first_header = virtual_sbrk(0);
-    //move program break to next byte
-    if (virtual_sbrk(HEADER_SIZE) == NULL){
-        return;
+void tree_insert(void * heapstart, uint8_t size, uint64_t serial){
+    //mark the block as FREE in its node, then walk up until a node already knows the size
+    TREE_NODE * nodes = tree_nodes(heapstart);
+    TREE_NODE bit = (TREE_NODE) 1 << (size - read_min_size(heapstart));
+    uint64_t node = pow_of_2(read_init_size(heapstart) - size) + serial;
+    uint64_t shared = tree_shared(heapstart);
+    while (node >= shared && (nodes[node] & bit) == 0){
+        node_store(nodes, node, nodes[node] | bit);
+        node = node >> 1;
     }
-    //initialize starting structure and the header of first block
-    write_start(heapstart,initial_size,min_size);
-    *first_header = 0;
-    writer_size(first_header,initial_size);
-    writer_status(first_header,FREE);
-
 }
 
-void * virtual_malloc(void * heapstart, uint32_t size) {
-
-    if(heapstart==NULL){
-        return NULL;
+void tree_remove(void * heapstart, uint8_t size, uint64_t serial){
+    //clear the block in its node, then walk up until a node does not change
+    TREE_NODE * nodes = tree_nodes(heapstart);
+    uint64_t node = pow_of_2(read_init_size(heapstart) - size) + serial;
+    uint64_t shared = tree_shared(heapstart);
+    if (size == read_min_size(heapstart)){
+        node_store(nodes, node, 0);
+    } else {
+        node_store(nodes, node, nodes[node << 1] | nodes[(node << 1) + 1]);
+    }
+    node = node >> 1;
+    while (node >= shared){
+        //a split block is never FREE itself, so its node is exactly the union of its children
+        TREE_NODE updated = nodes[node << 1] | nodes[(node << 1) + 1];
+        if (updated == nodes[node]){
+            return;
+        }
+        node_store(nodes, node, updated);
+        node = node >> 1;
     }
+}
 
-    if (validation(heapstart)==-1){
-        //if validation fail
-        return NULL;
+int64_t tree_best_from(void * heapstart, uint8_t * size, uint64_t root){
+    //pick the smallest FREE size at least the given size in the subtree of root, then descend to its lowest block
+    TREE_NODE * nodes = tree_nodes(heapstart);
+    uint8_t min_size = read_min_size(heapstart);
+    TREE_NODE fits = nodes[root] >> (*size - min_size);
+    if (fits == 0){
+        return -1;
+    }
+    *size = *size + __builtin_ctz(fits);
+    TREE_NODE bit = (TREE_NODE) 1 << (*size - min_size);
+    uint64_t node = root;
+    uint8_t depth = read_init_size(heapstart) - *size;
+    for (uint8_t level = 63 - __builtin_clzll(root); level < depth; level++){
+        node = node << 1;
+        if ((nodes[node] & bit) == 0){
+            node ++;
+        }
     }
-    //Compute the address of the header of first block
-    HEADER * header_ptr = heapstart + pow_of_2(read_init_size(heapstart)) + HEAPSTART_SIZE;
-    //Initialize as NULL, once there exist suitable block, it will point to the header of that block
-    HEADER * best_fit = NULL;
-    uint64_t best_fit_size = UINT64_MAX;
-    uint64_t current_size;
-    BYTE * best_fit_address;
-    //compute the address of each block in allocating space
-    BYTE * current_address = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    return node - pow_of_2(depth);
+}
 
-    uint64_t blocks = virtual_sbrk(0) - (void *)header_ptr;
-    uint64_t counter = 0;
+int64_t tree_best(void * heapstart, uint8_t * size){
+    //search the whole tree
+    return tree_best_from(heapstart, size, 1);
+}
 
-    if (size == 0){
-        return NULL;
+void index_insert(void * heapstart, uint8_t size, uint64_t serial){
+    //record a FREE block in the engine of the heap
+    if (read_mode(heapstart) & MODE_TREE){
+        tree_insert(heapstart, size, serial);
+    } else {
+        bitmap_insert(heapstart, size, serial);
     }
+}
 
-    while (counter < blocks){
-        //compute the actual size by taking the power
-        current_size = pow_of_2(read_size(*header_ptr));
+void index_remove(void * heapstart, uint8_t size, uint64_t serial){
+    //forget a FREE block in the engine of the heap
+    if (read_mode(heapstart) & MODE_TREE){
+        tree_remove(heapstart, size, serial);
+    } else {
+        bitmap_remove(heapstart, size, serial);
+    }
+}
 
-        if (read_status(*header_ptr) == FREE){
-            //Only consider blocks that with status of FREE
-            if (current_size >= size && current_size < best_fit_size){
-                //Update is there exist a better block
-                best_fit = header_ptr;
-                best_fit_address = current_address;
-                best_fit_size = current_size;
-            }
+int index_contains(void * heapstart, uint8_t size, uint64_t serial){
+    //check if the block with given size and serial is recorded as FREE in the engine of the heap
+    if (read_mode(heapstart) & MODE_TREE){
+        TREE_NODE * nodes = tree_nodes(heapstart);
+        TREE_NODE bit = (TREE_NODE) 1 << (size - read_min_size(heapstart));
+        uint64_t node = pow_of_2(read_init_size(heapstart) - size) + serial;
+        if (size == read_min_size(heapstart)){
+            return (nodes[node] & bit) != 0;
         }
-
-        //compute the address of next block in allocating space
-        current_address += current_size;
-        //compute the address of the header of next block
-        header_ptr += HEADER_SIZE;
-        //update counter
-        counter ++;
+        //a node also holds the sizes of its subtree, its own bit is only set when no child holds it
+        return (nodes[node] & bit) != 0 && ((nodes[node << 1] | nodes[(node << 1) + 1]) & bit) == 0;
     }
+    INDEX * levels[INDEX_LEVELS];
+    bitmap_levels(heapstart, size, levels);
+    return (levels[0][serial / INDEX_BITS] >> (serial % INDEX_BITS)) & 1;
+}
 
-    if(best_fit == NULL){
-        //if no suitable block found, return NULL
-        return NULL;
+int index_largest(void * heapstart){
+    //find the size of the largest FREE block, -1 if there is none
+    if (read_mode(heapstart) & MODE_TREE){
+        TREE_NODE root = tree_nodes(heapstart)[1];
+        if (root == 0){
+            return -1;
+        }
+        return read_min_size(heapstart) + sizeof(TREE_NODE) * 8 - 1 - __builtin_clz(root);
     }
-
-    HEADER * new_header;
-    uint8_t new_size_exp = read_size(*best_fit) -1;
-    uint64_t new_size = pow_of_2(new_size_exp);
-    //No matter if we can break, change the status of current block
-    writer_status(best_fit,IN_USE);
-
-    while (new_size >= size && new_size_exp >= read_min_size(heapstart)){
-        //continue breaking if we can break
-        new_header = add_block(best_fit);
-        if(new_header == NULL){
-            //if adding fails
-            return NULL;
+    for (int size = read_init_size(heapstart); size >= read_min_size(heapstart); size--){
+        if (bitmap_first(heapstart, size) >= 0){
+            return size;
         }
+    }
+    return -1;
+}
 
-        //initialize the new block
-        writer_status(new_header,FREE);
-        writer_size(new_header,new_size_exp);
-        //reduce the size of current block
-        writer_size(best_fit,new_size_exp);
-
-        //update the variables
-        new_size_exp = read_size(*best_fit) - 1;
-        new_size = pow_of_2(new_size_exp);
+int64_t index_best(void * heapstart, uint8_t * size){
+    /*
+     * Find the best fitting FREE block for the given size
+     * Return its serial and update size to the size of the block
+     * Return -1 if there is no FREE block large enough
+     */
+    if (read_mode(heapstart) & MODE_TREE){
+        return tree_best(heapstart, size);
     }
+    return bitmap_best(heapstart, size);
+}
 
-    return best_fit_address;
+/*
+ * TLSF Engine
+ * Used only by heaps initialized with init_allocator_tlsf, see TLSF in virtual_alloc.h
+ *
+ * |  0 ... 63  | ...... 2^(init_size) ...... | ..... |
+ * | heap start | blocks ... | end of heap |  lists  |
+ *
+ * Two-Level Segregated Fit keeps blocks of any multiple of 2^TLSF_ALIGN bytes, at least TLSF_MIN_BLOCK,
+ * instead of powers of 2. A block starts with a TLSF_BLOCK header of TLSF_HEADER bytes, the boundary tag
+ * holding its own size and the size of the block before it, so both neighbours of a freed block
+ * are found at once, and it merges with whichever is FREE.
+ * The end of heap is a header of size 0 after the last block, never FREE, so the last block needs no check.
+ *
+ * FREE blocks are kept in the list of their size class: the first level is the highest bit of the size,
+ * and the second level splits it into 2^TLSF_SL_BITS ranges. A request is rounded up to the next class,
+ * every block there fits, and the first non empty list from it is found from the bitmaps with two
+ * count trailing zeros, so malloc and free take constant time. Only when that finds nothing, the list
+ * of the request itself is walked for a block large enough. Split off remainders and merged blocks
+ * go to the head of their list.
+ *
+ * Heap start keeps the number of blocks and the total FREE size, walked and checked in MODE_PARANOID.
+ * min_size is TLSF_ALIGN, and MODE_THREAD_SAFE and MODE_PARANOID are the only modes.
+ */
+
+TLSF * tlsf_lists(void * heapstart){
+    //the free lists, aligned to a word after the allocating space
+    uintptr_t address = (uintptr_t)(heapstart + HEAPSTART_SIZE + pow_of_2(read_init_size(heapstart)));
+    address = (address + sizeof(uint64_t) - 1) & ~(uintptr_t)(sizeof(uint64_t) - 1);
+    return (TLSF *) address;
 }
 
-int virtual_free(void * heapstart, void * ptr) {
+int tlsf_path(void * heapstart){
+    //check if a heap uses the TLSF engine
+    return read_engine(heapstart) == ENGINE_TLSF;
+}
 
-    if(heapstart==NULL){
-        return 1;
-    }
+TLSF_BLOCK * tlsf_block(void * heapstart, uint32_t offset){
+    //the block at an offset in the allocating space
+    return (TLSF_BLOCK *) ((BYTE *) (heapstart + HEAPSTART_SIZE) + offset);
+}
 
-    if (validation(heapstart)==-1){
-        //if validation fail
-        return 1;
-    }
-    //Compute the address of the header of first block
-    HEADER * header_ptr = heapstart + pow_of_2(read_init_size(heapstart)) + HEAPSTART_SIZE;
-    HEADER * previous_ptr = NULL;
-    HEADER * next_ptr = NULL;
-    uint64_t current_size;
+uint32_t tlsf_offset(void * heapstart, TLSF_BLOCK * block){
+    //the offset of a block in the allocating space
+    return (BYTE *) block - (BYTE *) (heapstart + HEAPSTART_SIZE);
+}
 
-    //previous address needed for recursive case
-    BYTE * previous_address = NULL;
-    BYTE * current_address = (BYTE *) (heapstart + HEAPSTART_SIZE);
+uint32_t tlsf_size(TLSF_BLOCK * block){
+    //the size of a block with its header
+    return block->size & ~TLSF_FREE;
+}
 
-    uint64_t blocks = virtual_sbrk(0) - (void *)header_ptr;
-    uint64_t counter = 0;
+TLSF_BLOCK * tlsf_next(TLSF_BLOCK * block){
+    //the block after it in the allocating space
+    return (TLSF_BLOCK *) ((BYTE *) block + tlsf_size(block));
+}
 
-    while (counter < blocks){
-        //update next header
-        next_ptr = header_ptr + HEADER_SIZE;
-        current_size = pow_of_2(read_size(*header_ptr));
+void tlsf_mapping(uint32_t size, uint32_t * fl, uint32_t * sl){
+    //the list of a block size
+    if (size < (1u << (TLSF_SL_BITS + TLSF_ALIGN))){
+        *fl = 0;
+        *sl = size >> TLSF_ALIGN;
+    } else {
+        uint32_t top = 31 - __builtin_clz(size);
+        *fl = top - (TLSF_SL_BITS + TLSF_ALIGN) + 1;
+        *sl = (size >> (top - TLSF_SL_BITS)) ^ (1u << TLSF_SL_BITS);
+    }
+}
 
-        if (current_address == ptr){
-            //if block address matches ptr
-            //update status to free no matter if it is going to recursive
-            writer_status(header_ptr, FREE);
-            uint64_t serial = count_serial(heapstart,header_ptr);
+void tlsf_insert(void * heapstart, TLSF_BLOCK * block){
+    //put a FREE block at the head of its list
+    TLSF * lists = tlsf_lists(heapstart);
+    uint32_t fl;
+    uint32_t sl;
+    tlsf_mapping(tlsf_size(block), &fl, &sl);
+    block->prev = 0;
+    block->next = lists->heads[fl][sl];
+    if (block->next != 0){
+        tlsf_block(heapstart, block->next - 1)->prev = tlsf_offset(heapstart, block) + 1;
+    }
+    lists->heads[fl][sl] = tlsf_offset(heapstart, block) + 1;
+    lists->fl_bitmap |= 1u << fl;
+    lists->sl_bitmap[fl] |= 1u << sl;
+}
 
-            //break the recursive if it goes to the maximum size
-            if(read_size(*header_ptr) >= read_init_size(heapstart)){
-                return 0;
+void tlsf_remove(void * heapstart, TLSF_BLOCK * block){
+    //take a FREE block out of its list
+    TLSF * lists = tlsf_lists(heapstart);
+    uint32_t fl;
+    uint32_t sl;
+    tlsf_mapping(tlsf_size(block), &fl, &sl);
+    if (block->prev != 0){
+        tlsf_block(heapstart, block->prev - 1)->next = block->next;
+    } else {
+        lists->heads[fl][sl] = block->next;
+        if (block->next == 0){
+            lists->sl_bitmap[fl] &= ~(1u << sl);
+            if (lists->sl_bitmap[fl] == 0){
+                lists->fl_bitmap &= ~(1u << fl);
             }
+        }
+    }
+    if (block->next != 0){
+        tlsf_block(heapstart, block->next - 1)->prev = block->prev;
+    }
+}
 
-            if(previous_ptr != NULL && serial % 2 == 1){
-                //if serial is odd, try merge with the left(previous) block
-                if (read_size(*previous_ptr) == read_size(*header_ptr) && read_status(*previous_ptr) == FREE){
-                    //merge only if both is free and size is same
-
-                    //update size and remove the right side(current) block
-                    writer_size(previous_ptr,read_size(*previous_ptr + 1));
-                    remove_block(header_ptr);
-
-                    //recursively free
-                    virtual_free(heapstart,previous_address);
-                    return 0;
-                }
-            }else if (next_ptr != NULL && serial % 2 == 0){
-                //if serial is even, try merge with the right(next) block
-                if (read_size(*header_ptr) == read_size(*next_ptr) && read_status(*next_ptr) == FREE){
-                    //merge only if both is free and size is same
-
-                    //update size and remove the right side(next) block
-                    writer_size(header_ptr,read_size(*header_ptr + 1));
-                    remove_block(next_ptr);
-
-                    //recursively free
-                    virtual_free(heapstart,current_address);
-                    return 0;
-                }
-            }
-            return 0;
+TLSF_BLOCK * tlsf_fit(void * heapstart, uint32_t size){
+    //the first block holding size in the list of size itself, NULL if there is none
+    uint32_t fl;
+    uint32_t sl;
+    tlsf_mapping(size, &fl, &sl);
+    uint32_t entry = tlsf_lists(heapstart)->heads[fl][sl];
+    while (entry != 0){
+        TLSF_BLOCK * block = tlsf_block(heapstart, entry - 1);
+        if (tlsf_size(block) >= size){
+            return block;
         }
+        entry = block->next;
+    }
+    return NULL;
+}
 
-        //update looping variables
-        previous_address = current_address;
-        current_address += current_size;
-        previous_ptr = header_ptr;
-        header_ptr += HEADER_SIZE;
-        counter ++;
+TLSF_BLOCK * tlsf_find(void * heapstart, uint32_t size){
+    /*
+     * The first block of the first non empty list whose blocks all hold size
+     * Only when there is none, the list of size itself is searched, as its larger blocks may hold it
+     * Return NULL if no FREE block holds size
+     */
+    TLSF * lists = tlsf_lists(heapstart);
+    uint64_t rounded = size;
+    if (size >= (1u << (TLSF_SL_BITS + TLSF_ALIGN))){
+        rounded += (1u << (31 - __builtin_clz(size) - TLSF_SL_BITS)) - 1;
+    }
+    uint32_t fl = TLSF_FL_COUNT;
+    uint32_t sl = 0;
+    if (rounded < pow_of_2(31)){
+        tlsf_mapping(rounded, &fl, &sl);
+    }
+    uint32_t sl_map = fl < TLSF_FL_COUNT ? lists->sl_bitmap[fl] & (~0u << sl) : 0;
+    if (sl_map == 0){
+        uint32_t fl_map = fl + 1 < TLSF_FL_COUNT ? lists->fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (fl_map == 0){
+            return tlsf_fit(heapstart, size);
+        }
+        fl = __builtin_ctz(fl_map);
+        sl_map = lists->sl_bitmap[fl];
     }
+    sl = __builtin_ctz(sl_map);
+    return tlsf_block(heapstart, lists->heads[fl][sl] - 1);
+}
 
-    return 1;
+void tlsf_count(void * heapstart, int64_t blocks, int64_t free_size){
+    //update the counters in heap start
+    START * start = heapstart;
+    __atomic_store_n(&start->blocks, start->blocks + blocks, __ATOMIC_RELAXED);
+    __atomic_store_n(&start->free_size, start->free_size + free_size, __ATOMIC_RELAXED);
 }
 
-void * virtual_realloc(void * heapstart, void * ptr, uint32_t size) {
+void tlsf_split(void * heapstart, TLSF_BLOCK * block, uint32_t size){
+    //cut an allocated block down to size, the rest becomes a FREE block if it is large enough
+    uint32_t rest = tlsf_size(block) - size;
+    if (rest < TLSF_MIN_BLOCK){
+        return;
+    }
+    block->size = size;
+    TLSF_BLOCK * split = tlsf_next(block);
+    split->prev_size = size;
+    split->size = rest | TLSF_FREE;
+    TLSF_BLOCK * next = tlsf_next(split);
+    next->prev_size = rest;
+    tlsf_count(heapstart, 1, rest);
+    if (next->size & TLSF_FREE){
+        //the rest merges with the FREE block after it
+        tlsf_remove(heapstart, next);
+        split->size += tlsf_size(next);
+        tlsf_next(split)->prev_size = tlsf_size(split);
+        tlsf_count(heapstart, -1, 0);
+    }
+    tlsf_insert(heapstart, split);
+}
 
-    if(heapstart==NULL){
-        return NULL;
+uint32_t tlsf_request(uint32_t size){
+    //the block size holding a request, 0 if it is too large for any block
+    uint64_t block = ((uint64_t) size + TLSF_HEADER + pow_of_2(TLSF_ALIGN) - 1) & ~(pow_of_2(TLSF_ALIGN) - 1);
+    if (block < TLSF_MIN_BLOCK){
+        block = TLSF_MIN_BLOCK;
     }
+    return block >= pow_of_2(31) ? 0 : block;
+}
 
-    if (validation(heapstart)==-1){
-        //if validation fail
+TLSF_BLOCK * tlsf_entry(void * heapstart, void * ptr){
+    //the allocated block of a pointer given by tlsf_malloc, NULL if it is not one
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    if ((BYTE *) ptr < start + TLSF_HEADER || (BYTE *) ptr >= start + pow_of_2(read_init_size(heapstart))){
         return NULL;
     }
-
-    //Compute the address of the header of first block
-    HEADER * header_ptr = heapstart + pow_of_2(read_init_size(heapstart)) + HEAPSTART_SIZE;
-    //the block header which we reallocate to
-    HEADER * realloc_header;
-    uint64_t current_size;
-    uint64_t max_available_size = 0; //the maximum size we can obtain
-    uint64_t size_obtain_free; //the maximum size we can obtain if we free the given block
-    BYTE * current_address = (BYTE *) (heapstart + HEAPSTART_SIZE);
-    BYTE * new_address;
-
-    if(ptr == NULL){
-        //if pointer is NULL, go to malloc
-        return virtual_malloc(heapstart,size);
+    uint64_t offset = (BYTE *) ptr - TLSF_HEADER - start;
+    if (offset % pow_of_2(TLSF_ALIGN) != 0){
+        return NULL;
     }
-
-    if(size == 0){
-        //if size is 0, go to free
-        virtual_free(heapstart,ptr);
-        ptr = NULL;
+    TLSF_BLOCK * block = tlsf_block(heapstart, offset);
+    if ((block->size & TLSF_FREE) || block->size < TLSF_MIN_BLOCK ||
+        offset + block->size > pow_of_2(read_init_size(heapstart)) - TLSF_HEADER ||
+        block->prev_size > offset || tlsf_next(block)->prev_size != block->size){
         return NULL;
     }
+    return block;
+}
 
-    uint64_t blocks = virtual_sbrk(0) - (void *)header_ptr;
-    uint64_t counter = 0;
-
-    while (counter < blocks){
-        current_size = pow_of_2(read_size(*header_ptr));
-        if (read_status(*header_ptr) == FREE && current_size>max_available_size){
-            //if block is free and maximum can be updated
-            max_available_size = current_size;
+void tlsf_release(void * heapstart, TLSF_BLOCK * block){
+    //make an allocated block FREE, merged with the FREE blocks around it
+    tlsf_count(heapstart, 0, tlsf_size(block));
+    TLSF_BLOCK * next = tlsf_next(block);
+    if (next->size & TLSF_FREE){
+        tlsf_remove(heapstart, next);
+        block->size += tlsf_size(next);
+        tlsf_count(heapstart, -1, 0);
+    }
+    if (block->prev_size != 0){
+        TLSF_BLOCK * prev = (TLSF_BLOCK *) ((BYTE *) block - block->prev_size);
+        if (prev->size & TLSF_FREE){
+            tlsf_remove(heapstart, prev);
+            prev->size += tlsf_size(block);
+            block = prev;
+            tlsf_count(heapstart, -1, 0);
         }
+    }
+    block->size |= TLSF_FREE;
+    tlsf_next(block)->prev_size = tlsf_size(block);
+    tlsf_insert(heapstart, block);
+}
 
-        if (current_address == ptr){
-            realloc_header = header_ptr;
-            //compute the size we can obtain if we free the block
-            size_obtain_free = available_size(heapstart, header_ptr -1, header_ptr +1,
-                                              read_size(*header_ptr),count_serial(heapstart,header_ptr));
-            size_obtain_free = pow_of_2(size_obtain_free);
-
-            if(size_obtain_free > max_available_size){
-                //update if needed
-                max_available_size = size_obtain_free;
+int tlsf_full_validation(void * heapstart){
+    /*
+     * Walk every block, only done in MODE_PARANOID
+     * Every block must be large enough and tagged with the size of the block before it,
+     * no two FREE blocks may be next to each other, every FREE block must be in the list of its size,
+     * and the counters in heap start must match the blocks
+     */
+    START * start = heapstart;
+    TLSF * lists = tlsf_lists(heapstart);
+    uint64_t end = pow_of_2(read_init_size(heapstart)) - TLSF_HEADER;
+    uint64_t offset = 0;
+    uint32_t prev_size = 0;
+    uint64_t blocks = 0;
+    uint64_t free_size = 0;
+    while (offset < end){
+        TLSF_BLOCK * block = tlsf_block(heapstart, offset);
+        if (block->prev_size != prev_size || tlsf_size(block) < TLSF_MIN_BLOCK ||
+            tlsf_size(block) % pow_of_2(TLSF_ALIGN) != 0 || offset + tlsf_size(block) > end){
+            return -1;
+        }
+        if (block->size & TLSF_FREE){
+            uint32_t fl;
+            uint32_t sl;
+            tlsf_mapping(tlsf_size(block), &fl, &sl);
+            if ((offset > 0 && (tlsf_block(heapstart, offset - prev_size)->size & TLSF_FREE)) ||
+                !((lists->sl_bitmap[fl] >> sl) & 1)){
+                return -1;
             }
+            free_size += tlsf_size(block);
         }
-
-        //update looping variables
-        current_address += current_size;
-        header_ptr += HEADER_SIZE;
-        counter ++;
+        blocks ++;
+        prev_size = tlsf_size(block);
+        offset += prev_size;
     }
-
-    if (realloc_header != NULL && max_available_size >= size){
-        //if the size we can obtain is larger than the size we are going to reallocate
-        //Just free current block and allocate it again
-        uint64_t original = pow_of_2(read_size(*realloc_header));
-        virtual_free(heapstart,ptr);
-        new_address = virtual_malloc(heapstart,size);
-        //take the smaller one between current size and reallocate size
-        size = original > size ? size : original;
-        //move the contents from previous to the new block
-        memmove(new_address,ptr,size);
-        return new_address;
+    TLSF_BLOCK * last = tlsf_block(heapstart, end);
+    if (offset != end || last->size != 0 || last->prev_size != prev_size){
+        return -1;
     }
-
-    return NULL;
+    if (start->blocks != blocks || start->free_size != free_size){
+        return -1;
+    }
+    return 0;
 }
 
-void virtual_info(void * heapstart) {
+HEADER make_header(uint8_t status, uint8_t size){
+    // build the buddy data structure of a block
+    return (status << 7) | size;
+}
 
-    if(heapstart==NULL){
-        return;
+uint64_t header_hash(uint64_t position, HEADER h){
+    // hash of a header at its position in the block map, NO_BLOCK entries are not counted
+    if (h == NO_BLOCK){
+        return 0;
     }
+    return ((position << 8) | h) * 0x9E3779B97F4A7C15;
+}
 
-    if (validation(heapstart)==-1){
-        //if validation fail
-        return;
+void write_header(START *s, HEADER *h, HEADER value){
+    /*
+     * Update a header in the block map
+     * Keeping the number of blocks, the total FREE size and the checksum
+     * in heap start up to date, so they never need a walk of the block map
+     * With MODE_SUBTREE_LOCKS, the counters of the subtree holding the header are updated
+     * instead, under its lock, and summed into heap start when the heap lock is taken
+     * With MODE_STATS, the FREE blocks of every size are counted as well, in the same set
+     */
+    uint64_t position = h - block_map(s);
+    uint64_t * blocks = &s->blocks;
+    uint64_t * free_size = &s->free_size;
+    uint64_t * checksum = &s->checksum;
+    if (read_mode(s) & MODE_SUBTREE_LOCKS){
+        LOCK * lock = subtree_locks(s) + (position >> (subtree_size(s) - read_min_size(s)));
+        blocks = &lock->blocks;
+        free_size = &lock->free_size;
+        checksum = &lock->checksum;
     }
-    //Compute the address of the header of first block
-    HEADER * header_ptr = heapstart + pow_of_2(read_init_size(heapstart)) + HEAPSTART_SIZE;
+    uint64_t block_count = *blocks;
+    uint64_t free_count = *free_size;
+    if (*h != NO_BLOCK){
+        block_count --;
+        if (read_status(*h) == FREE){
+            free_count -= pow_of_2(read_size(*h));
+        }
+    }
+    if (value != NO_BLOCK){
+        block_count ++;
+        if (read_status(value) == FREE){
+            free_count += pow_of_2(read_size(value));
+        }
+    }
+    //validation reads the counters without a lock on the lock-free and thread cache paths
+    __atomic_store_n(blocks, block_count, __ATOMIC_RELAXED);
+    __atomic_store_n(free_size, free_count, __ATOMIC_RELAXED);
+    if (read_mode(s) & MODE_STATS){
+        uint64_t * free_blocks = stats_counters(s)[position >> (subtree_size(s) - read_min_size(s))].free_blocks;
+        if (*h != NO_BLOCK && read_status(*h) == FREE){
+            __atomic_store_n(&free_blocks[read_size(*h)], free_blocks[read_size(*h)] - 1, __ATOMIC_RELAXED);
+        }
+        if (value != NO_BLOCK && read_status(value) == FREE){
+            __atomic_store_n(&free_blocks[read_size(value)], free_blocks[read_size(value)] + 1, __ATOMIC_RELAXED);
+        }
+    }
+    (*checksum) ^= header_hash(position, *h) ^ header_hash(position, value);
+    (*h) = value;
+}
+
+static uint32_t heap_generations = 0;
+
+void write_start(START *s, uint8_t init_size, uint8_t min_size, uint8_t mode, uint8_t lock_depth){
+    //Update the data stores in the heap start
+    memset(s, 0, HEAPSTART_SIZE);
+    s->init_size = init_size;
+    s->min_size = min_size;
+    s->mode = mode;
+    s->lock_depth = lock_depth;
+    s->magic = HEAP_MAGIC;
+    s->generation = __atomic_add_fetch(&heap_generations, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Block Map
+ * One HEADER for every 2^(min_size) bytes of the allocating space,
+ * reserved when the allocator is initialized, so splitting and merging
+ * only rewrite the entries of the blocks involved
+ *
+ * The entry of the first 2^(min_size) bytes of a block holds its header,
+ * the entries covered by the rest of the block hold NO_BLOCK.
+ * A block is found from its address with (address - allocating space) >> min_size,
+ * and its buddy is the block at serial ^ 1, where the serial is
+ * the offset in allocating space / its size
+ * Serial examples:
+ *      0        1         1
+ * |size a-1|size a-1|   size a   |
+ *
+ *         0         2        3
+ * |   size a   |size a-1|size a-1|
+ */
+
+HEADER * map_slot(void * heapstart, BYTE * address){
+    //the entry of the block map covering the given address in allocating space
+    uint64_t offset = address - (BYTE *) (heapstart + HEAPSTART_SIZE);
+    return block_map(heapstart) + (offset >> read_min_size(heapstart)) * HEADER_SIZE;
+}
+
+HEADER * map_entry(void * heapstart, void * address){
+    /*
+     * The map entry of the block starting at the given address, NULL if no block starts there
+     * The free paths of the thread cache, the free stacks, the deferred queue and remote frees read it
+     * without a lock. A caller freeing a block holds it, and nothing else writes the header of an
+     * IN_USE block: merges only write FREE and covered entries, and only its holder resizes it.
+     * A double free, or two threads freeing one block, is a caller error there as with free(3):
+     * the second read may see the header before or after the first free changed it,
+     * so the block may be cached or queued twice. A block queued twice loops its queue, so the drains
+     * walk a queue at most once per map entry and the remote drain stops at a block merged already,
+     * leaving the blocks queued behind it allocated. A FREE header sends the block to the locked path,
+     * which reads it again there and merges it as far as it can, as virtual_free always has.
+     */
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    if ((BYTE *) address < start){
+        return NULL;
+    }
+    uint64_t offset = (BYTE *) address - start;
+    if (offset >= pow_of_2(read_init_size(heapstart)) || offset % pow_of_2(read_min_size(heapstart)) != 0){
+        return NULL;
+    }
+    HEADER * entry = map_slot(heapstart, address);
+    if (*entry == NO_BLOCK){
+        return NULL;
+    }
+    return entry;
+}
+
+/*
+ * Heap Lock
+ * Used only by heaps initialized with MODE_THREAD_SAFE, stored in heap start
+ *
+ * Lock word: 0 unlocked
+ *            1 locked
+ *            2 locked, and threads may be sleeping on it
+ *
+ * A thread first spins, with exponential backoff between attempts, for about as long
+ * as recent lockers needed, kept as a running average in lock_spins,
+ * then sleeps on the lock word with a futex. Unlock only wakes a thread if one may sleep.
+ */
+
+void cpu_relax(void){
+    //tell the processor we are spinning
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void mutex_lock(uint32_t * lock, uint32_t * spins){
+    //lock the given lock word, spinning adaptively before sleeping
+    uint32_t limit = __atomic_load_n(spins, __ATOMIC_RELAXED) * 2 + LOCK_SPIN_MIN;
+    if (limit > LOCK_SPIN_MAX){
+        limit = LOCK_SPIN_MAX;
+    }
+    for (uint32_t attempt = 0; attempt < limit; attempt++){
+        uint32_t expected = 0;
+        if (__atomic_load_n(lock, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(lock, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            //move the average towards the spins this locker needed
+            uint32_t average = __atomic_load_n(spins, __ATOMIC_RELAXED);
+            __atomic_store_n(spins, average + ((int32_t) (attempt - average)) / 8, __ATOMIC_RELAXED);
+            return;
+        }
+        for (uint32_t i = 0; i < (1u << (attempt < 6 ? attempt : 6)); i++){
+            cpu_relax();
+        }
+    }
+
+    //sleep until the lock is given up, marking it as having sleepers
+    while (__atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE) != 0){
+        syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+    uint32_t average = __atomic_load_n(spins, __ATOMIC_RELAXED);
+    __atomic_store_n(spins, average + (limit - average) / 8, __ATOMIC_RELAXED);
+}
+
+void mutex_unlock(uint32_t * lock){
+    //unlock the given lock word, waking one sleeper if there may be one
+    if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2){
+        syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * Statistics
+ * Used only by heaps initialized with MODE_STATS, see COUNTERS in virtual_alloc.h
+ *
+ * Each lock guards one set of counters, the set of its subtree with MODE_SUBTREE_LOCKS,
+ * or the only set otherwise. Taking the lock makes the sequence of the set odd, and releasing it
+ * makes it even again, a seqlock whose writers are the lock holders, which pay two stores for it.
+ * virtual_stats reads a set, with the counters kept next to its lock, again whenever the sequence
+ * was odd or changed meanwhile, so it sees the set as some lock holder left it and never blocks.
+ * With MODE_SUBTREE_LOCKS, every set is consistent on its own and the sets are added up.
+ */
+
+void stats_begin(void * heapstart, uint64_t set){
+    //start changing a set of counters, its lock must be held
+    if (read_mode(heapstart) & MODE_STATS){
+        COUNTERS * counters = stats_counters(heapstart) + set;
+        __atomic_store_n(&counters->sequence, counters->sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+}
+
+void stats_end(void * heapstart, uint64_t set){
+    //finish changing a set of counters, before its lock is released
+    if (read_mode(heapstart) & MODE_STATS){
+        COUNTERS * counters = stats_counters(heapstart) + set;
+        __atomic_store_n(&counters->sequence, counters->sequence + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void subtree_lock(void * heapstart, uint64_t subtree){
+    LOCK * lock = subtree_locks(heapstart) + subtree;
+    mutex_lock(&lock->lock, &lock->spins);
+    stats_begin(heapstart, subtree);
+}
+
+void subtree_unlock(void * heapstart, uint64_t subtree){
+    LOCK * lock = subtree_locks(heapstart) + subtree;
+    stats_end(heapstart, subtree);
+    mutex_unlock(&lock->lock);
+}
+
+uint64_t thread_subtree(void * heapstart){
+    //the subtree a thread tries first, the arena of its CPU with MODE_PER_CPU, or from a hash of its thread id
+    if (read_mode(heapstart) & MODE_PER_CPU){
+        int cpu = sched_getcpu();
+        if (cpu >= 0){
+            return cpu & (subtree_count(heapstart) - 1);
+        }
+    }
+    uint64_t hash = (uint64_t) pthread_self() * 0x9E3779B97F4A7C15;
+    return (hash >> 32) & (subtree_count(heapstart) - 1);
+}
+
+void sum_subtrees(void * heapstart){
+    //publish the sums of the subtree counters in heap start, every subtree lock must be held
+    START * start = heapstart;
+    LOCK * locks = subtree_locks(heapstart);
+    uint64_t blocks = 0;
+    uint64_t free_size = 0;
+    uint64_t checksum = 0;
+    for (uint64_t i = 0; i < subtree_count(heapstart); i++){
+        blocks += locks[i].blocks;
+        free_size += locks[i].free_size;
+        checksum ^= locks[i].checksum;
+    }
+    //threads in the subtree paths check them without a lock
+    __atomic_store_n(&start->blocks, blocks, __ATOMIC_RELAXED);
+    __atomic_store_n(&start->free_size, free_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&start->checksum, checksum, __ATOMIC_RELAXED);
+}
+
+void tree_rebuild(void * heapstart){
+    /*
+     * Recompute the nodes above lock depth, every subtree lock must be held
+     * Such a node is the union of its children, with its own bit if its block is FREE
+     */
+    TREE_NODE * nodes = tree_nodes(heapstart);
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    for (uint64_t node = subtree_count(heapstart) - 1; node >= 1; node--){
+        uint8_t depth = 63 - __builtin_clzll(node);
+        uint8_t size = read_init_size(heapstart) - depth;
+        nodes[node] = nodes[node << 1] | nodes[(node << 1) + 1];
+        if (*map_slot(heapstart, start + ((node - pow_of_2(depth)) << size)) == make_header(FREE, size)){
+            nodes[node] |= (TREE_NODE) 1 << (size - read_min_size(heapstart));
+        }
+    }
+}
+
+int full_validation(void * heapstart){
+    /*
+     * Walk the whole block map, only done in MODE_PARANOID
+     * Every block must start with a valid header and cover only NO_BLOCK entries,
+     * be in the free block index exactly when it is FREE,
+     * and the counters and checksum kept in heap start must match the block map
+     */
+    START * start = heapstart;
+    HEADER * map = block_map(heapstart);
+    uint64_t entries = pow_of_2(read_init_size(heapstart) - read_min_size(heapstart));
+    uint64_t counter = 0;
+    uint64_t sum_size = 0;
+    uint64_t free_size = 0;
+    uint64_t blocks = 0;
+    uint64_t checksum = 0;
+
+    while (counter < entries){
+        HEADER h = map[counter];
+        if(h == NO_BLOCK || read_size(h)>64 || read_size(h)<read_min_size(heapstart)){
+            return -1;
+        }
+        if (read_weight(h) && (read_status(h) == FREE || read_engine(heapstart) != ENGINE_WEIGHTED)){
+            //weighted blocks are IN_USE blocks of the weighted engine only
+            return -1;
+        }
+        uint64_t covered = block_bytes(h) >> read_min_size(heapstart);
+        uint64_t serial = counter >> (read_size(h) - read_min_size(heapstart));
+        if (counter % pow_of_2(read_size(h) + 2 * read_weight(h) - read_min_size(heapstart)) != 0 || counter + covered > entries){
+            //a block must start at a multiple of its size, a weighted block at the block of 4 * 2^(size) it was cut from
+            return -1;
+        }
+        for (uint64_t i = 1; i < covered; i++){
+            if (map[counter + i] != NO_BLOCK){
+                return -1;
+            }
+        }
+
+        //only FREE blocks are in the free block index
+        if (index_contains(heapstart, read_size(h), serial) != (read_status(h) == FREE)){
+            return -1;
+        }
+
+        sum_size += block_bytes(h);
+        if (read_status(h) == FREE){
+            free_size += pow_of_2(read_size(h));
+        }
+        blocks ++;
+        checksum ^= header_hash(counter, h);
+        counter += covered;
+    }
+
+    //check if block structure valid
+    if (pow_of_2(read_init_size(heapstart)) != sum_size){
+        return -1;
+    }
+    if (start->blocks != blocks || start->free_size != free_size || start->checksum != checksum){
+        return -1;
+    }
+    return 0;
+}
+
+int shape_validation(void * heapstart){
+    /*
+     * Check the magic number and the sizes, reading nothing but heap start
+     * Nothing checked here changes after initialization, so no lock is needed
+     */
+    if(heapstart==NULL){
+        return -1;
+    }
+    START * start = heapstart;
+    if (start->magic != HEAP_MAGIC){
+        return -1;
+    }
+    //check if initial size and minimum size valid
+    if (read_init_size(heapstart) > 64 || read_min_size(heapstart) > 64){
+        return -1;
+    }
+    if (read_init_size(heapstart) < read_min_size(heapstart)){
+        return -1;
+    }
+    return 0;
+}
+
+int break_validation(void * heapstart){
+    /*
+     * Check that the data structures are below the program break
+     * virtual_sbrk may not be called by two threads at once, so this is only done under the heap lock
+     */
+    //check if virtual_sbrk working
+    if (virtual_sbrk(0) == NULL){
+        return -1;
+    }
+
+    if (tlsf_path(heapstart)){
+        //the free lists of the TLSF engine must be below the program break
+        return virtual_sbrk(0) < (void *) (tlsf_lists(heapstart) + 1) ? -1 : 0;
+    }
+
+    //check if the block map and the subtree locks are below the program break
+    uint64_t entries = pow_of_2(read_init_size(heapstart) - read_min_size(heapstart));
+    if (virtual_sbrk(0) < (void *) (block_map(heapstart) + entries * HEADER_SIZE)){
+        return -1;
+    }
+    if ((read_mode(heapstart) & MODE_SUBTREE_LOCKS) &&
+        virtual_sbrk(0) < (void *) (subtree_locks(heapstart) + subtree_count(heapstart))){
+        return -1;
+    }
+    if ((read_mode(heapstart) & MODE_LOCK_FREE) && virtual_sbrk(0) < (void *) (free_stacks(heapstart) + STACK_ORDERS)){
+        return -1;
+    }
+    if ((read_mode(heapstart) & MODE_STATS) && virtual_sbrk(0) < (void *) (stats_counters(heapstart) + subtree_count(heapstart))){
+        return -1;
+    }
+    return 0;
+}
+
+int validation(void * heapstart){
+    /*
+     * Check if the allocating data structure is valid
+     * If some unexpected behavior happened, or data structure modification detected
+     * it will report an error
+     * Only the heap start is checked here, the block map is kept consistent by write_header
+     * and walked only in MODE_PARANOID
+     * The counters only add up between two calls, and virtual_sbrk is not thread safe,
+     * so callers without the heap lock use shape_validation
+     */
+    if (shape_validation(heapstart) == -1 || break_validation(heapstart) == -1){
+        return -1;
+    }
+    START * start = heapstart;
+    uint64_t entries = pow_of_2(read_init_size(heapstart) - read_min_size(heapstart));
+
+    //check if the counters kept in heap start are possible, with MODE_SUBTREE_LOCKS they are published by the heap lock
+    uint64_t blocks = __atomic_load_n(&start->blocks, __ATOMIC_RELAXED);
+    uint64_t free_size = __atomic_load_n(&start->free_size, __ATOMIC_RELAXED);
+    if (blocks == 0 || blocks > entries || free_size > pow_of_2(read_init_size(heapstart))){
+        return -1;
+    }
+
+    if (read_mode(heapstart) & MODE_PARANOID){
+        return tlsf_path(heapstart) ? tlsf_full_validation(heapstart) : full_validation(heapstart);
+    }
+    return 0;
+}
+
+void init_allocator(void * heapstart, uint8_t initial_size, uint8_t min_size) {
+    init_allocator_mode(heapstart, initial_size, min_size, MODE_BITMAP);
+}
+
+void init_allocator_mode(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode) {
+    //subtree locks go as deep as the default, or as the sizes allow
+    uint8_t depth = SUBTREE_DEPTH_DEFAULT;
+    if (initial_size > min_size && initial_size - min_size <= depth){
+        depth = initial_size - min_size - 1;
+    }
+    init_allocator_subtrees(heapstart, initial_size, min_size, mode, depth);
+}
+
+void init_allocator_arenas(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode, uint32_t arenas) {
+    //one subtree for each arena, rounded up to a power of 2, one arena for each online CPU if arenas is 0
+    if (arenas == 0){
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        arenas = cpus > 0 ? cpus : 1;
+    }
+    uint8_t depth = 1;
+    while (pow_of_2(depth) < arenas && depth < SUBTREE_DEPTH_MAX){
+        depth ++;
+    }
+    //with more CPUs than the sizes allow arenas for, CPUs share arenas
+    if (initial_size > min_size && depth >= initial_size - min_size){
+        depth = initial_size - min_size - 1;
+    }
+    init_allocator_subtrees(heapstart, initial_size, min_size, mode | MODE_TREE | MODE_SUBTREE_LOCKS | MODE_PER_CPU, depth);
+}
+
+void init_allocator_tlsf(void * heapstart, uint8_t initial_size, uint8_t mode) {
+    //initialize a heap of the TLSF engine, with MODE_THREAD_SAFE and MODE_PARANOID as its only modes
+    if(heapstart==NULL){
+        return;
+    }
+    if (initial_size < 5 || initial_size > 31 || (mode & ~(MODE_THREAD_SAFE | MODE_PARANOID))){
+        //the heap holds one block and the end of heap, and every size fits the 31 bits of a header
+        return;
+    }
+    uint64_t current_size = virtual_sbrk(0)-heapstart;
+    if (virtual_sbrk(pow_of_2(initial_size) - current_size + HEAPSTART_SIZE) == NULL){
+        return;
+    }
+    write_start(heapstart,initial_size,TLSF_ALIGN,mode,0);
+    ((START *) heapstart)->engine = ENGINE_TLSF;
+
+    //the free lists follow the allocating space, all empty
+    TLSF * lists = tlsf_lists(heapstart);
+    if (virtual_sbrk((void *)(lists + 1) - virtual_sbrk(0)) == NULL){
+        return;
+    }
+    memset(lists, 0, sizeof(TLSF));
+
+    //one FREE block covers the allocating space up to the end of heap
+    uint32_t size = pow_of_2(initial_size) - TLSF_HEADER;
+    TLSF_BLOCK * first = tlsf_block(heapstart, 0);
+    first->prev_size = 0;
+    first->size = size | TLSF_FREE;
+    TLSF_BLOCK * end = tlsf_block(heapstart, size);
+    end->prev_size = size;
+    end->size = 0;
+    tlsf_insert(heapstart, first);
+    tlsf_count(heapstart, 1, size);
+}
+
+void init_allocator_engine(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode, uint8_t depth, uint8_t engine) {
+
+    if(heapstart==NULL){
+        return;
+    }
+    if ((mode & MODE_TREE) && (size_t) (initial_size - min_size) >= sizeof(TREE_NODE) * 8){
+        //a node cannot hold a bit for every size
+        return;
+    }
+    if ((mode & MODE_STATS) && initial_size >= STATS_SIZES){
+        //the counters hold sizes up to 2^(STATS_SIZES - 1)
+        return;
+    }
+    if ((mode & MODE_LOCK_FREE) && (initial_size - min_size >= 32 || min_size < 2)){
+        //a stack links blocks by their 32 bit block map entry, stored in the block
+        return;
+    }
+    if (mode & MODE_SUBTREE_LOCKS){
+        //the subtrees are subtrees of the tree engine, and each needs room for two blocks
+        if (!(mode & MODE_TREE) || depth == 0 || depth > SUBTREE_DEPTH_MAX || depth >= initial_size - min_size){
+            return;
+        }
+        //a remote free queue links blocks by their 32 bit block map entry, stored in the block
+        if (min_size < 2){
+            return;
+        }
+    } else {
+        depth = 0;
+    }
+    //calculate current space and extend the program break
+    uint64_t current_size = virtual_sbrk(0)-heapstart;
+
+    if (virtual_sbrk(pow_of_2(initial_size) - current_size + HEAPSTART_SIZE) == NULL){
+        return;
+    }
+    write_start(heapstart,initial_size,min_size,mode,depth);
+    ((START *) heapstart)->engine = engine;
+
+    //extend the program break to hold the free block index of the chosen engine
+    INDEX * index = free_index(heapstart);
+    uint64_t words = 1;
+    if (mode & MODE_TREE){
+        words += tree_words(initial_size, min_size);
+    } else {
+        words += initial_size - min_size + 1;
+        for (uint8_t size = min_size; size <= initial_size; size++){
+            words += bitmap_words(pow_of_2(initial_size - size));
+        }
+    }
+    //the block map follows the index, one entry for every minimum size block
+    uint64_t entries = pow_of_2(initial_size - min_size);
+    if (virtual_sbrk((void *)(index + words) - virtual_sbrk(0) + entries * HEADER_SIZE) == NULL){
+        return;
+    }
+    memset(index, 0, words * sizeof(INDEX));
+    index[0] = words;
+    if (!(mode & MODE_TREE)){
+        //fill the size table of the bitmap engine
+        uint64_t offset = initial_size - min_size + 2;
+        for (uint8_t size = min_size; size <= initial_size; size++){
+            index[1 + size - min_size] = offset;
+            offset += bitmap_words(pow_of_2(initial_size - size));
+        }
+    }
+
+    if (mode & MODE_SUBTREE_LOCKS){
+        //the subtree locks follow the block map, all unlocked, nobody else can use the heap yet
+        LOCK * locks = subtree_locks(heapstart);
+        if (virtual_sbrk((void *)(locks + subtree_count(heapstart)) - virtual_sbrk(0)) == NULL){
+            return;
+        }
+        memset(locks, 0, subtree_count(heapstart) * sizeof(LOCK));
+        ((START *) heapstart)->heap_held = 1;
+    }
+    if (mode & MODE_LOCK_FREE){
+        //the free stacks follow, all empty
+        STACK * stacks = free_stacks(heapstart);
+        if (virtual_sbrk((void *)(stacks + STACK_ORDERS) - virtual_sbrk(0)) == NULL){
+            return;
+        }
+        memset(stacks, 0, STACK_ORDERS * sizeof(STACK));
+    }
+    if (mode & MODE_STATS){
+        //the statistics counters follow, counting the first block below
+        COUNTERS * counters = stats_counters(heapstart);
+        if (virtual_sbrk((void *)(counters + subtree_count(heapstart)) - virtual_sbrk(0)) == NULL){
+            return;
+        }
+        memset(counters, 0, subtree_count(heapstart) * sizeof(COUNTERS));
+    }
+
+    //initialize the header of first block, the rest of the map is covered by it
+    HEADER * first_header = block_map(heapstart);
+    memset(first_header, NO_BLOCK, entries * HEADER_SIZE);
+    write_header(heapstart,first_header,make_header(FREE,initial_size));
+    index_insert(heapstart,initial_size,0);
+
+    if (mode & MODE_SUBTREE_LOCKS){
+        sum_subtrees(heapstart);
+        ((START *) heapstart)->heap_held = 0;
+    }
+}
+
+void init_allocator_subtrees(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode, uint8_t depth) {
+    init_allocator_engine(heapstart, initial_size, min_size, mode, depth, ENGINE_BUDDY);
+}
+
+void init_allocator_weighted(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode) {
+    //initialize a heap of the weighted buddy engine, see Weighted Buddy, without the per-thread modes
+    if (mode & (MODE_SUBTREE_LOCKS | MODE_TCACHE | MODE_LOCK_FREE | MODE_PER_CPU)){
+        return;
+    }
+    init_allocator_engine(heapstart, initial_size, min_size, mode, 0, ENGINE_WEIGHTED);
+}
+
+int fit_size(void * heapstart, uint32_t size){
+    //find the smallest block size that can hold the request, -1 if even the whole heap is too small
+    uint8_t fit = read_min_size(heapstart);
+    while (pow_of_2(fit) < size && fit < read_init_size(heapstart)){
+        fit ++;
+    }
+    if (pow_of_2(fit) < size){
+        return -1;
+    }
+    return fit;
+}
+
+BYTE * place_block(void * heapstart, int64_t serial, uint8_t best_fit_exp, uint8_t fit){
+    /*
+     * Take the FREE block with given size and serial and split it down to fit,
+     * the right halves split off become FREE blocks
+     */
+    BYTE * best_fit_address = (BYTE *) (heapstart + HEAPSTART_SIZE) + (serial << best_fit_exp);
+    HEADER * best_fit = map_slot(heapstart,best_fit_address);
+    index_remove(heapstart,best_fit_exp,serial);
+
+    while (best_fit_exp > fit){
+        //continue breaking if we can break, the right half gets its own entry in the block map
+        best_fit_exp --;
+        serial = serial << 1;
+        write_header(heapstart,map_slot(heapstart,best_fit_address + pow_of_2(best_fit_exp)),make_header(FREE,best_fit_exp));
+        index_insert(heapstart,best_fit_exp,serial + 1);
+    }
+    write_header(heapstart,best_fit,make_header(IN_USE,fit));
+
+    return best_fit_address;
+}
+
+BYTE * allocate_block(void * heapstart, uint8_t fit){
+    /*
+     * Take the FREE block with the lowest address among the smallest size at least fit,
+     * and split it down to fit
+     * Return NULL if there is no FREE block large enough
+     */
+    uint8_t best_fit_exp = fit;
+    int64_t serial = index_best(heapstart,&best_fit_exp);
+
+    if(serial < 0){
+        //if no suitable block found, return NULL
+        return NULL;
+    }
+    return place_block(heapstart,serial,best_fit_exp,fit);
+}
+
+void merge_block_upto(void * heapstart, BYTE * address, uint8_t size, uint8_t limit){
+    /*
+     * Mark a block FREE and merge it with its buddy, level by level, as long as the buddy
+     * is FREE and has the same size and the merged block is not larger than limit,
+     * then index the merged block once
+     * The buddy of the block at offset o with size k is at o ^ 2^k,
+     * and the merged block starts at o with the bit 2^k cleared
+     */
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint64_t offset = address - start;
+    //the block may be indexed already if it was FREE
+    index_remove(heapstart,size,offset >> size);
+
+    while (size < limit){
+        HEADER * buddy = map_slot(heapstart, start + (offset ^ pow_of_2(size)));
+        if (*buddy == NO_BLOCK || read_size(*buddy) != size || read_status(*buddy) != FREE){
+            //merge only if both is free and size is same
+            break;
+        }
+        index_remove(heapstart,size,(offset >> size) ^ 1);
+        //the right side block is covered by the merged block
+        write_header(heapstart,map_slot(heapstart,start + (offset | pow_of_2(size))),NO_BLOCK);
+        offset = offset & ~pow_of_2(size);
+        size ++;
+    }
+
+    write_header(heapstart,map_slot(heapstart,start + offset),make_header(FREE,size));
+    index_insert(heapstart,size,offset >> size);
+}
+
+void merge_block(void * heapstart, BYTE * address, uint8_t size){
+    //free a block, merging as far as possible
+    merge_block_upto(heapstart,address,size,read_init_size(heapstart));
+}
+
+/*
+ * Weighted Buddy
+ * Used only by heaps initialized with init_allocator_weighted (ENGINE_WEIGHTED)
+ * Besides the blocks of 2^k, a request of at most 3 * 2^k bytes gets a weighted block of 3 * 2^k,
+ * so at most a third of a block is unused instead of half of it
+ *
+ * A weighted block is cut from a block of 2^(k+2): it keeps the first three quarters,
+ * and the last quarter becomes a FREE block of 2^k whose buddy is covered by the weighted block.
+ * Once freed, a weighted block splits 2:1 into FREE blocks of 2^(k+1) and 2^k, which merge as usual,
+ * so FREE blocks, the free block index and every buddy computation stay those of the binary buddy
+ * The cut quarters only merge once the block next to them is freed, so the engine trades internal
+ * for external fragmentation: it wastes less inside its blocks but leaves FREE blocks too small
+ * for later requests, and uses less of a full heap when requests are just over 2^k, see bench.c
+ */
+
+int weighted_path(void * heapstart){
+    //check if a heap uses the weighted buddy engine
+    return read_engine(heapstart) == ENGINE_WEIGHTED;
+}
+
+int weighted_fit(void * heapstart, uint32_t size, uint8_t fit){
+    //check if a request with a block of 2^fit fits the weighted block of 3 * 2^(fit - 2) instead
+    return weighted_path(heapstart) && fit >= read_min_size(heapstart) + 2 && size <= 3 * pow_of_2(fit - 2);
+}
+
+void weighted_trim(void * heapstart, BYTE * address, uint8_t fit){
+    //turn an IN_USE block of 2^fit into a weighted block of 3 * 2^(fit - 2) by freeing its last quarter
+    write_header(heapstart,map_slot(heapstart,address),make_header(IN_USE,fit - 2) | WEIGHTED);
+    merge_block(heapstart,address + 3 * pow_of_2(fit - 2),fit - 2);
+}
+
+BYTE * place_request(void * heapstart, uint32_t size){
+    //allocate the smallest block that can hold the request, NULL if there is none
+    int fit = size == 0 ? -1 : fit_size(heapstart,size);
+    if (fit < 0){
+        return NULL;
+    }
+    BYTE * address = allocate_block(heapstart,fit);
+    if (address != NULL && weighted_fit(heapstart,size,fit)){
+        weighted_trim(heapstart,address,fit);
+    }
+    return address;
+}
+
+void release_block(void * heapstart, BYTE * address){
+    //free an IN_USE block, merging as far as possible, a weighted block is split 2:1 first
+    HEADER h = *map_slot(heapstart,address);
+    if (read_weight(h)){
+        merge_block_upto(heapstart,address,read_size(h) + 1,read_size(h) + 1);
+        merge_block(heapstart,address + pow_of_2(read_size(h) + 1),read_size(h));
+        return;
+    }
+    merge_block(heapstart,address,read_size(h));
+}
+
+void * heap_malloc(void * heapstart, uint32_t size) {
+
+    if(heapstart==NULL){
+        return NULL;
+    }
+
+    if (validation(heapstart)==-1){
+        //if validation fail
+        return NULL;
+    }
+    if (size == 0){
+        return NULL;
+    }
+
+    //place the smallest block that can hold the request
+    return place_request(heapstart,size);
+}
+
+int heap_malloc_batch(void * heapstart, const uint32_t * sizes, void ** out, size_t n) {
+    /*
+     * Allocate n blocks, validating the heap once
+     * Blocks are placed in order exactly like n calls to virtual_malloc would place them,
+     * so later requests take the halves split off by earlier ones
+     * Either every request succeeds and 0 is returned, or the blocks already placed are
+     * freed again, every out[i] is NULL and 1 is returned
+     */
+    if(heapstart==NULL || sizes==NULL || out==NULL){
+        return 1;
+    }
+
+    if (validation(heapstart)==-1){
+        //if validation fail
+        return 1;
+    }
+
+    for (size_t i = 0; i < n; i++){
+        out[i] = place_request(heapstart,sizes[i]);
+
+        if (out[i] == NULL){
+            //roll back from the last block placed, which restores the heap exactly
+            while (i > 0){
+                i --;
+                release_block(heapstart,out[i]);
+                out[i] = NULL;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int heap_free(void * heapstart, void * ptr) {
+
+    if(heapstart==NULL){
+        return 1;
+    }
+
+    if (validation(heapstart)==-1){
+        //if validation fail
+        return 1;
+    }
+
+    //look up the block in the block map
+    HEADER * entry = map_entry(heapstart,ptr);
+    if (entry == NULL){
+        return 1;
+    }
+    release_block(heapstart,ptr);
+    return 0;
+}
+
+int compare_address(const void * a, const void * b){
+    //order pointers by address for qsort
+    BYTE * left = *(BYTE * const *) a;
+    BYTE * right = *(BYTE * const *) b;
+    return (left > right) - (left < right);
+}
+
+int heap_free_batch(void * heapstart, void ** ptrs, size_t n) {
+    /*
+     * Free n blocks, validating the heap once
+     * ptrs is sorted by address and every entry is set to NULL once its block is released
+     * Return 1 without freeing anything if a pointer is not an allocated block or appears twice
+     *
+     * All blocks are marked FREE first, then merged in one bottom-up sweep:
+     * at each size, from the smallest, the blocks of that size merge with a FREE buddy.
+     * Every merge of a lower size is done before a size is swept, and a block and its buddy
+     * are next to each other in address order, so each block is looked at once per size
+     */
+    if(heapstart==NULL || ptrs==NULL){
+        return 1;
+    }
+
+    if (validation(heapstart)==-1){
+        //if validation fail
+        return 1;
+    }
+
+    qsort(ptrs, n, sizeof(void *), compare_address);
+    for (size_t i = 0; i < n; i++){
+        HEADER * entry = map_entry(heapstart,ptrs[i]);
+        if (entry == NULL || read_status(*entry) == FREE || (i > 0 && ptrs[i] == ptrs[i - 1])){
+            return 1;
+        }
+    }
+
+    //weighted blocks are freed one by one, they are not blocks of the sweep
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++){
+        if (read_weight(*map_slot(heapstart,ptrs[i]))){
+            release_block(heapstart,ptrs[i]);
+            continue;
+        }
+        ptrs[kept] = ptrs[i];
+        kept ++;
+    }
+    for (size_t i = kept; i < n; i++){
+        ptrs[i] = NULL;
+    }
+    n = kept;
+
+    //mark every block FREE, they are indexed once they stop merging
+    for (size_t i = 0; i < n; i++){
+        HEADER * entry = map_slot(heapstart,ptrs[i]);
+        write_header(heapstart,entry,make_header(FREE,read_size(*entry)));
+    }
+
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    for (uint8_t size = read_min_size(heapstart); size < read_init_size(heapstart); size++){
+        size_t alive = 0;
+        for (size_t i = 0; i < n; i++){
+            BYTE * address = ptrs[i];
+            if (address == NULL){
+                //merged into the block before it
+                continue;
+            }
+            ptrs[alive] = address;
+            alive ++;
+            if (read_size(*map_slot(heapstart,address)) != size){
+                continue;
+            }
+            uint64_t offset = address - start;
+            HEADER * buddy = map_slot(heapstart, start + (offset ^ pow_of_2(size)));
+            if (*buddy == NO_BLOCK || read_size(*buddy) != size || read_status(*buddy) != FREE){
+                continue;
+            }
+
+            //the buddy may be an indexed FREE block, or the next block of this batch
+            index_remove(heapstart,size,(offset >> size) ^ 1);
+            if (i + 1 < n && ptrs[i + 1] == start + (offset ^ pow_of_2(size))){
+                ptrs[i + 1] = NULL;
+            }
+            offset = offset & ~pow_of_2(size);
+            write_header(heapstart,map_slot(heapstart,start + (offset | pow_of_2(size))),NO_BLOCK);
+            write_header(heapstart,map_slot(heapstart,start + offset),make_header(FREE,size + 1));
+            ptrs[alive - 1] = start + offset;
+        }
+        for (size_t i = alive; i < n; i++){
+            ptrs[i] = NULL;
+        }
+        n = alive;
+    }
+
+    //index the merged blocks
+    for (size_t i = 0; i < n; i++){
+        uint8_t size = read_size(*map_slot(heapstart,ptrs[i]));
+        index_insert(heapstart,size,((BYTE *) ptrs[i] - start) >> size);
+        ptrs[i] = NULL;
+    }
+    return 0;
+}
+
+void shrink_block(void * heapstart, BYTE * address, uint8_t size, uint8_t target){
+    /*
+     * Split an IN_USE block in place down to the target size
+     * The right halves are freed from the largest to the smallest, none of them can merge
+     * since their buddy is the part of the block that is kept
+     */
+    write_header(heapstart,map_slot(heapstart,address),make_header(IN_USE,target));
+    while (size > target){
+        size --;
+        merge_block(heapstart,address + pow_of_2(size),size);
+    }
+}
+
+int grow_block(void * heapstart, BYTE * address, uint8_t size, uint8_t target){
+    /*
+     * Grow an IN_USE block in place up to the target size by absorbing its right buddies
+     * Possible only if at every level the block is the left buddy and the right buddy is FREE
+     * with the same size
+     * Return 0 on success, 1 if the block cannot grow in place, without changing anything
+     */
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint64_t offset = address - start;
+    for (uint8_t level = size; level < target; level++){
+        HEADER * buddy = map_slot(heapstart,address + pow_of_2(level));
+        if ((offset & pow_of_2(level)) != 0){
+            return 1;
+        }
+        if (*buddy == NO_BLOCK || read_size(*buddy) != level || read_status(*buddy) != FREE){
+            return 1;
+        }
+    }
+    for (uint8_t level = size; level < target; level++){
+        index_remove(heapstart,level,(offset >> level) + 1);
+        write_header(heapstart,map_slot(heapstart,address + pow_of_2(level)),NO_BLOCK);
+    }
+    write_header(heapstart,map_slot(heapstart,address),make_header(IN_USE,target));
+    return 0;
+}
+
+void * heap_realloc(void * heapstart, void * ptr, uint32_t size) {
+
+    if(heapstart==NULL){
+        return NULL;
+    }
+
+    if (validation(heapstart)==-1){
+        //if validation fail
+        return NULL;
+    }
+
+    BYTE * new_address;
+
+    if(ptr == NULL){
+        //if pointer is NULL, go to malloc
+        return heap_malloc(heapstart,size);
+    }
+
+    if(size == 0){
+        //if size is 0, go to free
+        heap_free(heapstart,ptr);
+        ptr = NULL;
+        return NULL;
+    }
+
+    //the block header which we reallocate to
+    HEADER * realloc_header = map_entry(heapstart,ptr);
+    if (realloc_header == NULL || read_status(*realloc_header) == FREE){
+        return NULL;
+    }
+
+    //keep the block where it is if it already has the right size, can be split, or can absorb its buddies
+    int fit = fit_size(heapstart,size);
+    if (fit < 0){
+        return NULL;
+    }
+    int weighted = weighted_fit(heapstart,size,fit);
+    if (read_weight(*realloc_header)){
+        uint8_t kept = read_size(*realloc_header) + 1;
+        if (weighted && fit - 2 == read_size(*realloc_header)){
+            return ptr;
+        }
+        if (size > pow_of_2(kept)){
+            //a weighted block never grows in place
+            new_address = place_request(heapstart,size);
+            if (new_address != NULL){
+                memcpy(new_address,ptr,block_bytes(*realloc_header));
+                release_block(heapstart,ptr);
+            }
+            return new_address;
+        }
+        //give back the last third, the rest is a block of 2^(size + 1) handled as any other
+        write_header(heapstart,realloc_header,make_header(IN_USE,kept));
+        merge_block(heapstart,(BYTE *) ptr + pow_of_2(kept),kept - 1);
+    }
+    if (fit == read_size(*realloc_header)){
+        if (weighted){
+            weighted_trim(heapstart,ptr,fit);
+        }
+        return ptr;
+    }
+    if (fit < read_size(*realloc_header)){
+        shrink_block(heapstart,ptr,read_size(*realloc_header),fit);
+        if (weighted){
+            weighted_trim(heapstart,ptr,fit);
+        }
+        return ptr;
+    }
+    if (grow_block(heapstart,ptr,read_size(*realloc_header),fit) == 0){
+        if (weighted){
+            weighted_trim(heapstart,ptr,fit);
+        }
+        return ptr;
+    }
+
+    //the maximum size we can obtain, from the largest FREE block
+    uint64_t max_available_size = 0;
+    int largest = index_largest(heapstart);
+    if (largest >= 0){
+        max_available_size = pow_of_2(largest);
+    }
+    //compute the size we can obtain if we free the block
+    uint64_t size_obtain_free = pow_of_2(available_size(heapstart, ptr, read_size(*realloc_header)));
+    if(size_obtain_free > max_available_size){
+        //update if needed
+        max_available_size = size_obtain_free;
+    }
+
+    if (max_available_size >= size){
+        //if the size we can obtain is larger than the size we are going to reallocate
+        uint64_t original = pow_of_2(read_size(*realloc_header));
+        //Just free current block and allocate it again
+        merge_block(heapstart,ptr,read_size(*realloc_header));
+        new_address = allocate_block(heapstart,fit);
+        if (weighted){
+            weighted_trim(heapstart,new_address,fit);
+        }
+        //take the smaller one between current size and reallocate size
+        size = original > size ? size : original;
+        //move the contents from previous to the new block
+        memmove(new_address,ptr,size);
+        return new_address;
+    }
+
+    return NULL;
+}
+
+void heap_info(void * heapstart) {
+
+    if(heapstart==NULL){
+        return;
+    }
+
+    if (validation(heapstart)==-1){
+        //if validation fail
+        return;
+    }
+    //walk the blocks through the block map
+    HEADER * header_ptr = block_map(heapstart);
+
+    uint64_t entries = pow_of_2(read_init_size(heapstart) - read_min_size(heapstart));
+    uint64_t counter = 0;
+    while (counter < entries){
+        //continue reading and printing blocks
+        if (read_status(*header_ptr) == FREE){
+            printf("free %lu\n",block_bytes(*header_ptr));
+        } else if (read_status(*header_ptr) == IN_USE){
+            printf("allocated %lu\n",block_bytes(*header_ptr));
+        } else {
+            return;
+        }
+        counter += block_bytes(*header_ptr) >> read_min_size(heapstart);
+        header_ptr = block_map(heapstart) + counter * HEADER_SIZE;
+    }
+}
+
+/*
+ * TLSF calls, the heap lock must be held, see TLSF Engine
+ */
+
+void * tlsf_malloc(void * heapstart, uint32_t size){
+    //allocate from the TLSF free lists, the heap lock must be held
+    if (validation(heapstart)==-1 || size == 0){
+        return NULL;
+    }
+    uint32_t needed = tlsf_request(size);
+    TLSF_BLOCK * block = needed == 0 ? NULL : tlsf_find(heapstart, needed);
+    if (block == NULL){
+        return NULL;
+    }
+    tlsf_remove(heapstart, block);
+    block->size &= ~TLSF_FREE;
+    tlsf_count(heapstart, 0, -(int64_t) block->size);
+    tlsf_split(heapstart, block, needed);
+    return (BYTE *) block + TLSF_HEADER;
+}
+
+int tlsf_free(void * heapstart, void * ptr){
+    //free to the TLSF free lists, the heap lock must be held
+    if (validation(heapstart)==-1){
+        return 1;
+    }
+    TLSF_BLOCK * block = tlsf_entry(heapstart, ptr);
+    if (block == NULL){
+        return 1;
+    }
+    tlsf_release(heapstart, block);
+    return 0;
+}
+
+void * tlsf_realloc(void * heapstart, void * ptr, uint32_t size){
+    //resize in place when the block or the FREE block after it has room, else move, the heap lock must be held
+    if (ptr == NULL){
+        return tlsf_malloc(heapstart, size);
+    }
+    if (size == 0){
+        tlsf_free(heapstart, ptr);
+        return NULL;
+    }
+    if (validation(heapstart)==-1){
+        return NULL;
+    }
+    TLSF_BLOCK * block = tlsf_entry(heapstart, ptr);
+    uint32_t needed = tlsf_request(size);
+    if (block == NULL || needed == 0){
+        return NULL;
+    }
+    TLSF_BLOCK * next = tlsf_next(block);
+    if (needed > block->size && (next->size & TLSF_FREE) && block->size + tlsf_size(next) >= needed){
+        tlsf_remove(heapstart, next);
+        tlsf_count(heapstart, -1, -(int64_t) tlsf_size(next));
+        block->size += tlsf_size(next);
+        tlsf_next(block)->prev_size = block->size;
+    }
+    if (needed <= block->size){
+        tlsf_split(heapstart, block, needed);
+        return ptr;
+    }
+    void * moved = tlsf_malloc(heapstart, size);
+    if (moved == NULL){
+        return NULL;
+    }
+    memcpy(moved, ptr, block->size - TLSF_HEADER);
+    tlsf_release(heapstart, block);
+    return moved;
+}
+
+int tlsf_malloc_batch(void * heapstart, const uint32_t * sizes, void ** out, size_t n){
+    //allocate n blocks, all or none, like heap_malloc_batch
+    if (sizes == NULL || out == NULL){
+        return 1;
+    }
+    for (size_t i = 0; i < n; i++){
+        out[i] = tlsf_malloc(heapstart, sizes[i]);
+        if (out[i] == NULL){
+            while (i > 0){
+                i --;
+                tlsf_free(heapstart, out[i]);
+                out[i] = NULL;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int tlsf_free_batch(void * heapstart, void ** ptrs, size_t n){
+    //free n blocks, or none if a pointer is not an allocated block or appears twice, like heap_free_batch
+    if (ptrs == NULL || validation(heapstart)==-1){
+        return 1;
+    }
+    qsort(ptrs, n, sizeof(void *), compare_address);
+    for (size_t i = 0; i < n; i++){
+        if (tlsf_entry(heapstart, ptrs[i]) == NULL || (i > 0 && ptrs[i] == ptrs[i - 1])){
+            return 1;
+        }
+    }
+    for (size_t i = 0; i < n; i++){
+        tlsf_release(heapstart, tlsf_entry(heapstart, ptrs[i]));
+        ptrs[i] = NULL;
+    }
+    return 0;
+}
+
+void tlsf_info(void * heapstart){
+    //print every block in address order, the heap lock must be held
+    if (validation(heapstart)==-1){
+        return;
+    }
+    uint64_t end = pow_of_2(read_init_size(heapstart)) - TLSF_HEADER;
+    for (uint64_t offset = 0; offset < end; offset += tlsf_size(tlsf_block(heapstart, offset))){
+        TLSF_BLOCK * block = tlsf_block(heapstart, offset);
+        printf("%s %u\n", (block->size & TLSF_FREE) ? "free" : "allocated", tlsf_size(block));
+    }
+}
+
+void merge_subtrees(void * heapstart){
+    //do the merges crossing a subtree boundary, every subtree lock must be held and the shared nodes rebuilt
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint8_t top = subtree_size(heapstart);
+    for (uint64_t i = 0; i < subtree_count(heapstart); i++){
+        HEADER * root = map_slot(heapstart, start + (i << top));
+        if (*root == make_header(FREE, top)){
+            merge_block(heapstart, start + (i << top), top);
+        }
+    }
+}
+
+void remote_push(void * heapstart, uint64_t subtree, BYTE * address){
+    //push a block freed by another subtree onto the remote free queue of its subtree
+    uint32_t * queue = &subtree_locks(heapstart)[subtree].remote;
+    uint32_t entry = ((address - (BYTE *) (heapstart + HEAPSTART_SIZE)) >> read_min_size(heapstart)) + 1;
+    uint32_t head = __atomic_load_n(queue, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n((uint32_t *) address, head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(queue, &head, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void remote_drain(void * heapstart, uint64_t subtree){
+    //free every block in the remote free queue of a subtree, its lock must be held
+    uint32_t * queue = &subtree_locks(heapstart)[subtree].remote;
+    if (__atomic_load_n(queue, __ATOMIC_RELAXED) == 0){
+        return;
+    }
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint32_t entry = __atomic_exchange_n(queue, 0, __ATOMIC_ACQUIRE);
+    //a block queued twice links the queue into a loop, so it is walked at most once per map entry,
+    //and stops at a block already merged, whose link is stale
+    uint64_t limit = pow_of_2(read_init_size(heapstart) - read_min_size(heapstart));
+    uint64_t taken = 0;
+    while (entry != 0 && entry <= limit && taken < limit){
+        BYTE * address = start + ((uint64_t) (entry - 1) << read_min_size(heapstart));
+        HEADER h = *map_slot(heapstart, address);
+        if (h == NO_BLOCK || read_status(h) != IN_USE){
+            return;
+        }
+        entry = __atomic_load_n((uint32_t *) address, __ATOMIC_RELAXED);
+        merge_block_upto(heapstart, address, read_size(h), subtree_size(heapstart));
+        taken ++;
+    }
+}
+
+void drain_stashes(void * heapstart){
+    //give back every stolen block waiting in a stash and every block in a remote free queue,
+    //every subtree lock must be held and the shared nodes rebuilt
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    LOCK * locks = subtree_locks(heapstart);
+    for (uint64_t i = 0; i < subtree_count(heapstart); i++){
+        for (uint32_t j = 0; j < locks[i].stolen; j++){
+            BYTE * address = start + ((uint64_t) locks[i].stash[j] << read_min_size(heapstart));
+            merge_block(heapstart, address, read_size(*map_slot(heapstart, address)));
+        }
+        __atomic_store_n(&locks[i].stolen, 0, __ATOMIC_RELAXED);
+        remote_drain(heapstart, i);
+    }
+}
+
+void heap_lock(void * heapstart){
+    //lock the heap if it is shared between threads
+    START * start = heapstart;
+    if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+        for (uint64_t i = 0; i < subtree_count(heapstart); i++){
+            subtree_lock(heapstart, i);
+        }
+        start->heap_held = 1;
+        tree_rebuild(heapstart);
+        drain_stashes(heapstart);
+        merge_subtrees(heapstart);
+        sum_subtrees(heapstart);
+    } else {
+        if (read_mode(heapstart) & MODE_THREAD_SAFE){
+            mutex_lock(&start->lock, &start->lock_spins);
+        }
+        stats_begin(heapstart, 0);
+    }
+}
+
+void heap_unlock(void * heapstart){
+    //unlock the heap if it is shared between threads
+    START * start = heapstart;
+    if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+        sum_subtrees(heapstart);
+        start->heap_held = 0;
+        for (uint64_t i = subtree_count(heapstart); i > 0; i--){
+            subtree_unlock(heapstart, i - 1);
+        }
+    } else {
+        stats_end(heapstart, 0);
+        if (read_mode(heapstart) & MODE_THREAD_SAFE){
+            mutex_unlock(&start->lock);
+        }
+    }
+}
+
+/*
+ * Subtree paths of MODE_SUBTREE_LOCKS
+ * A block smaller than a subtree is allocated, freed and resized in place holding only
+ * the lock of its subtree. Everything else, and MODE_PARANOID, goes through the heap lock.
+ * Only heap start is checked without the heap lock, the program break under it, see validation.
+ */
+
+int carve_subtree(void * heapstart, uint64_t subtree){
+    /*
+     * Split the FREE block covering the given subtree down to the subtree, with the heap lock held,
+     * so a thread fills its own subtree instead of the lowest address of the heap
+     * At every level the half not holding the subtree becomes a FREE block
+     * Return 1 if the subtree is not covered by a FREE block larger than it
+     */
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint8_t top = subtree_size(heapstart);
+    uint64_t offset = subtree << top;
+    for (uint8_t size = top + 1; size <= read_init_size(heapstart); size++){
+        uint64_t block = offset & ~(pow_of_2(size) - 1);
+        HEADER h = *map_slot(heapstart, start + block);
+        if (h == NO_BLOCK){
+            continue;
+        }
+        if (h != make_header(FREE, size)){
+            return 1;
+        }
+        index_remove(heapstart, size, block >> size);
+        while (size > top){
+            size --;
+            uint64_t half = block | (offset & pow_of_2(size));
+            write_header(heapstart, map_slot(heapstart, start + block), make_header(FREE, size));
+            write_header(heapstart, map_slot(heapstart, start + block + pow_of_2(size)), make_header(FREE, size));
+            index_insert(heapstart, size, (half ^ pow_of_2(size)) >> size);
+            block = half;
+        }
+        index_insert(heapstart, top, subtree);
+        return 0;
+    }
+    return 1;
+}
+
+int subtree_path(void * heapstart){
+    //check if a call can go through the subtree paths
+    return (read_mode(heapstart) & (MODE_SUBTREE_LOCKS | MODE_PARANOID)) == MODE_SUBTREE_LOCKS;
+}
+
+int subtree_in_heap(void * heapstart, void * ptr){
+    //check if a pointer is in allocating space, so it has a subtree
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    return (BYTE *) ptr >= start && (BYTE *) ptr < start + pow_of_2(read_init_size(heapstart));
+}
+
+int subtree_fits(void * heapstart, uint64_t subtree, uint8_t fit){
+    //check without locking if the root of a subtree shows a FREE block large enough
+    TREE_NODE * nodes = tree_nodes(heapstart);
+    TREE_NODE root = __atomic_load_n(&nodes[subtree_count(heapstart) + subtree], __ATOMIC_RELAXED);
+    return (root >> (fit - read_min_size(heapstart))) != 0;
+}
+
+BYTE * subtree_place(void * heapstart, uint64_t subtree, uint8_t fit){
+    //allocate a block of the given size in a subtree, its lock must be held
+    uint8_t best_fit_exp = fit;
+    int64_t serial = tree_best_from(heapstart,&best_fit_exp,subtree_count(heapstart) + subtree);
+    return serial < 0 ? NULL : place_block(heapstart,serial,best_fit_exp,fit);
+}
+
+BYTE * stash_take(void * heapstart, uint64_t subtree, uint8_t fit){
+    //take a stolen block of the given size from the stash of a subtree, its lock must be held
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    LOCK * lock = subtree_locks(heapstart) + subtree;
+    for (uint32_t j = 0; j < lock->stolen; j++){
+        BYTE * address = start + ((uint64_t) lock->stash[j] << read_min_size(heapstart));
+        if (read_size(*map_slot(heapstart, address)) == fit){
+            __atomic_store_n(&lock->stolen, lock->stolen - 1, __ATOMIC_RELAXED);
+            lock->stash[j] = lock->stash[lock->stolen];
+            return address;
+        }
+    }
+    return NULL;
+}
+
+BYTE * subtree_steal(void * heapstart, uint64_t thief, uint8_t fit){
+    /*
+     * Steal blocks of the given size from the sibling with the most FREE space that has one,
+     * return one of them and put the others in the stash of the thief
+     * The batch is limited by the room in the stash and by half the FREE space of the sibling
+     */
+    LOCK * locks = subtree_locks(heapstart);
+    uint64_t victim = thief;
+    uint64_t most = 0;
+    for (uint64_t i = 0; i < subtree_count(heapstart); i++){
+        uint64_t free_size = __atomic_load_n(&locks[i].free_size, __ATOMIC_RELAXED);
+        if (i != thief && free_size > most && subtree_fits(heapstart,i,fit)){
+            victim = i;
+            most = free_size;
+        }
+    }
+    if (victim == thief){
+        return NULL;
+    }
+    //the stash is only read without its lock to size the batch
+    uint32_t batch = 1 + (STEAL_BATCH - __atomic_load_n(&locks[thief].stolen, __ATOMIC_RELAXED));
+    if (batch > (most >> 1) >> fit){
+        batch = (most >> 1) >> fit;
+    }
+    BYTE * blocks[STEAL_BATCH + 1];
+    uint32_t n = 0;
+    subtree_lock(heapstart,victim);
+    blocks[0] = subtree_place(heapstart,victim,fit);
+    if (blocks[0] != NULL){
+        n = 1;
+        while (n < batch && (blocks[n] = subtree_place(heapstart,victim,fit)) != NULL){
+            n ++;
+        }
+    }
+    subtree_unlock(heapstart,victim);
+    if (n > 1){
+        BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+        uint32_t i = 1;
+        subtree_lock(heapstart,thief);
+        while (i < n && locks[thief].stolen < STEAL_BATCH){
+            locks[thief].stash[locks[thief].stolen] = (blocks[i] - start) >> read_min_size(heapstart);
+            __atomic_store_n(&locks[thief].stolen, locks[thief].stolen + 1, __ATOMIC_RELAXED);
+            i ++;
+        }
+        subtree_unlock(heapstart,thief);
+        if (i < n){
+            //the stash filled up meanwhile, the rest goes back
+            subtree_lock(heapstart,victim);
+            while (i < n){
+                merge_block_upto(heapstart,blocks[i],fit,subtree_size(heapstart));
+                i ++;
+            }
+            subtree_unlock(heapstart,victim);
+        }
+    }
+    return blocks[0];
+}
+
+void * subtree_malloc(void * heapstart, uint32_t size) {
+    /*
+     * Try the subtree of this thread first, skipping it if its root shows no FREE block
+     * large enough without locking it, then the blocks stashed there, then steal from a sibling
+     * If no subtree has one, take the heap lock and split the FREE block covering
+     * the subtree of this thread, or any block large enough
+     */
+    if (shape_validation(heapstart)==-1 || size == 0){
+        return NULL;
+    }
+    int fit = fit_size(heapstart,size);
+    if (fit < 0){
+        return NULL;
+    }
+
+    //read once, a thread moved to another CPU in between would carve one subtree and search another
+    uint64_t own = thread_subtree(heapstart);
+    if (fit < subtree_size(heapstart)){
+        BYTE * address = NULL;
+        subtree_lock(heapstart,own);
+        remote_drain(heapstart,own);
+        if (subtree_fits(heapstart,own,fit)){
+            address = subtree_place(heapstart,own,fit);
+        }
+        if (address == NULL){
+            address = stash_take(heapstart,own,fit);
+        }
+        subtree_unlock(heapstart,own);
+        if (address == NULL){
+            address = subtree_steal(heapstart,own,fit);
+        }
+        if (address != NULL){
+            return address;
+        }
+    }
+
+    heap_lock(heapstart);
+    void * ptr = NULL;
+    if (fit < subtree_size(heapstart) && carve_subtree(heapstart,own) == 0){
+        uint8_t best_fit_exp = fit;
+        uint64_t root = subtree_count(heapstart) + own;
+        int64_t serial = tree_best_from(heapstart,&best_fit_exp,root);
+        if (serial >= 0){
+            ptr = place_block(heapstart,serial,best_fit_exp,fit);
+        }
+    }
+    if (ptr == NULL){
+        ptr = allocate_block(heapstart,fit);
+    }
+    heap_unlock(heapstart);
+    return ptr;
+}
+
+int subtree_free(void * heapstart, void * ptr) {
+    //merge the block inside its subtree only, merges crossing the boundary wait for the heap lock
+    if (shape_validation(heapstart)==-1 || !subtree_in_heap(heapstart,ptr)){
+        return 1;
+    }
+    uint64_t subtree = subtree_of(heapstart,ptr);
+    uint8_t top = subtree_size(heapstart);
+
+    if (subtree != thread_subtree(heapstart)){
+        //read without the subtree lock, see map_entry
+        HEADER * entry = map_entry(heapstart,ptr);
+        if (entry == NULL){
+            return 1;
+        }
+        if (read_status(*entry) == IN_USE && read_size(*entry) < top){
+            remote_push(heapstart,subtree,ptr);
+            return 0;
+        }
+    }
+    subtree_lock(heapstart,subtree);
+    HEADER * entry = map_entry(heapstart,ptr);
+    if (entry == NULL || read_size(*entry) >= top){
+        subtree_unlock(heapstart,subtree);
+        if (entry == NULL){
+            return 1;
+        }
+        heap_lock(heapstart);
+        int result = heap_free(heapstart,ptr);
+        heap_unlock(heapstart);
+        return result;
+    }
+    merge_block_upto(heapstart,ptr,read_size(*entry),top);
+    subtree_unlock(heapstart,subtree);
+    return 0;
+}
+
+void * subtree_realloc(void * heapstart, void * ptr, uint32_t size) {
+    //resize in place under the subtree lock when both sizes are smaller than a subtree, otherwise use the heap lock
+    if (ptr == NULL){
+        return subtree_malloc(heapstart,size);
+    }
+    if (size == 0){
+        subtree_free(heapstart,ptr);
+        return NULL;
+    }
+    if (shape_validation(heapstart)==-1 || !subtree_in_heap(heapstart,ptr)){
+        return NULL;
+    }
+    int fit = fit_size(heapstart,size);
+    if (fit < 0){
+        return NULL;
+    }
+    uint64_t subtree = subtree_of(heapstart,ptr);
+
+    subtree_lock(heapstart,subtree);
+    HEADER * entry = map_entry(heapstart,ptr);
+    if (entry == NULL || read_status(*entry) == FREE){
+        subtree_unlock(heapstart,subtree);
+        return NULL;
+    }
+    uint8_t current = read_size(*entry);
+    if (current < subtree_size(heapstart) && fit < subtree_size(heapstart)){
+        if (fit <= current){
+            shrink_block(heapstart,ptr,current,fit);
+            subtree_unlock(heapstart,subtree);
+            return ptr;
+        }
+        if (grow_block(heapstart,ptr,current,fit) == 0){
+            subtree_unlock(heapstart,subtree);
+            return ptr;
+        }
+    }
+    subtree_unlock(heapstart,subtree);
+
+    heap_lock(heapstart);
+    void * new_address = heap_realloc(heapstart,ptr,size);
+    heap_unlock(heapstart);
+    return new_address;
+}
+
+void * buddy_malloc(void * heapstart, uint32_t size) {
+    //allocate from the buddy blocks, through the subtree paths or the heap lock
+    if (subtree_path(heapstart)){
+        return subtree_malloc(heapstart,size);
+    }
+    heap_lock(heapstart);
+    void * ptr = heap_malloc(heapstart,size);
+    heap_unlock(heapstart);
+    return ptr;
+}
+
+int buddy_free(void * heapstart, void * ptr) {
+    //free to the buddy blocks, through the subtree paths or the heap lock
+    if (subtree_path(heapstart)){
+        return subtree_free(heapstart,ptr);
+    }
+    heap_lock(heapstart);
+    int result = heap_free(heapstart,ptr);
+    heap_unlock(heapstart);
+    return result;
+}
+
+/*
+ * Free Stacks
+ * Used only by heaps initialized with MODE_LOCK_FREE, see STACK in virtual_alloc.h
+ *
+ * A freed block of one of the STACK_ORDERS smallest sizes is pushed onto the stack of its size,
+ * and virtual_malloc pops it again, both with one compare and swap on the head and no lock.
+ * Stacked blocks stay IN_USE in the block map, so splitting and merging, done with the locks
+ * as before, never see them. A block holds the link to the block below it in its first 4 bytes.
+ *
+ * The tag in the head changes on every push and pop, so a pop that read a block which was
+ * popped and pushed again meanwhile fails its compare and swap (the ABA problem).
+ * The block below may be read after another thread took the top block, which is harmless
+ * as the memory is always part of the heap.
+ *
+ * A stack holds about STACK_DEPTH blocks and 1 / 2^STACK_SHARE of the allocating space at most,
+ * further frees merge as usual. The stacks are drained back into the buddy blocks by virtual_info,
+ * and by virtual_malloc and virtual_realloc before they give up. MODE_PARANOID bypasses them.
+ */
+
+#define STACK_ENTRY 0xFFFFFFFFull
+
+int stack_path(void * heapstart){
+    //check if a call can go through the free stacks
+    return (read_mode(heapstart) & (MODE_LOCK_FREE | MODE_PARANOID)) == MODE_LOCK_FREE;
+}
+
+int stack_push(void * heapstart, uint8_t order, BYTE * address){
+    //push a block onto the stack of its size, return 1 if the stack is full
+    STACK * stack = free_stacks(heapstart) + order;
+    uint32_t count = __atomic_load_n(&stack->count, __ATOMIC_RELAXED);
+    uint8_t size = read_min_size(heapstart) + order;
+    if (count >= STACK_DEPTH || ((uint64_t) count + 1) << size > pow_of_2(read_init_size(heapstart) - STACK_SHARE)){
+        return 1;
+    }
+    uint64_t entry = (address - (BYTE *) (heapstart + HEAPSTART_SIZE)) >> read_min_size(heapstart);
+    uint64_t head = __atomic_load_n(&stack->head, __ATOMIC_RELAXED);
+    uint64_t updated;
+    do {
+        __atomic_store_n((uint32_t *) address, (uint32_t) (head & STACK_ENTRY), __ATOMIC_RELAXED);
+        updated = ((head & ~STACK_ENTRY) + (STACK_ENTRY + 1)) | (entry + 1);
+    } while (!__atomic_compare_exchange_n(&stack->head, &head, updated, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&stack->count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+BYTE * stack_pop(void * heapstart, uint8_t order){
+    //pop the top block of the stack of a size, NULL if it is empty
+    STACK * stack = free_stacks(heapstart) + order;
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint64_t head = __atomic_load_n(&stack->head, __ATOMIC_ACQUIRE);
+    while ((head & STACK_ENTRY) != 0){
+        BYTE * address = start + (((head & STACK_ENTRY) - 1) << read_min_size(heapstart));
+        uint64_t below = __atomic_load_n((uint32_t *) address, __ATOMIC_RELAXED);
+        uint64_t updated = ((head & ~STACK_ENTRY) + (STACK_ENTRY + 1)) | below;
+        if (__atomic_compare_exchange_n(&stack->head, &head, updated, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+            __atomic_sub_fetch(&stack->count, 1, __ATOMIC_RELAXED);
+            return address;
+        }
+    }
+    return NULL;
+}
+
+void stack_drain(void * heapstart){
+    //merge every stacked block back into the buddy blocks, the heap lock must be held
+    if (!stack_path(heapstart)){
+        //without MODE_LOCK_FREE there are no stacks, only what an earlier heap left past the block map
+        return;
+    }
+    for (uint8_t order = 0; order < STACK_ORDERS; order++){
+        BYTE * address;
+        while ((address = stack_pop(heapstart,order)) != NULL){
+            merge_block(heapstart,address,read_min_size(heapstart) + order);
+        }
+    }
+    if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+        //the merges went to the subtree counters, publish them for validation
+        sum_subtrees(heapstart);
+    }
+}
+
+/*
+ * Maintenance
+ * Used only by heaps with a maintenance thread, see virtual_maintenance_start and MAINTENANCE in virtual_alloc.h
+ *
+ * While the thread runs, virtual_free of a block which does not go to a free stack only pushes it
+ * onto the deferred queue in heap start, with one compare and swap and no lock, and the thread
+ * does the merges later, DEFERRED_BATCH blocks at a time with heap_free_batch. Queued blocks stay
+ * IN_USE in the block map, and hold the link to the block queued before them in their first 4 bytes.
+ *
+ * The thread wakes once wake_batch blocks are pending, once the interval runs out, or when stopped.
+ * On every pass it drains the queue, refills the free stacks of MODE_LOCK_FREE that ran low
+ * to REFILL_DEPTH blocks (thread caches are thread local, so only their owners refill them),
+ * and gives the whole pages of every FREE block of at least 2^trim bytes a drain merged into
+ * back to the OS with madvise. FREE blocks hold no data, so losing their contents is harmless.
+ *
+ * virtual_maintenance_drain does a pass in the calling thread. virtual_malloc and virtual_realloc
+ * drain the queue before they give up, and virtual_info drains it first. A block freed while
+ * virtual_maintenance_stop runs may stay queued until the next of those.
+ * A heap must not be initialized again while its thread runs. MODE_PARANOID bypasses the queue.
+ */
+
+static MAINTENANCE * maintenance_registry = NULL;
+static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int deferred_path(void * heapstart){
+    //check if a free can be queued for the maintenance thread
+    START * start = heapstart;
+    return __atomic_load_n(&start->wake_batch, __ATOMIC_RELAXED) != 0 && !(read_mode(heapstart) & MODE_PARANOID);
+}
+
+int deferred_queued(void * heapstart){
+    //check if blocks wait in the deferred queue or in a drain, which only takes them off pending once merged
+    //a call reads it before and after trying, so a block freed before it failed is either merged or seen here
+    START * start = heapstart;
+    return __atomic_load_n(&start->pending, __ATOMIC_RELAXED) != 0;
+}
+
+void deferred_push(void * heapstart, BYTE * address){
+    //queue a block for the maintenance thread, waking it when the queue reaches its batch
+    START * start = heapstart;
+    uint32_t entry = ((address - (BYTE *) (heapstart + HEAPSTART_SIZE)) >> read_min_size(heapstart)) + 1;
+    //counted first, so pending is never below the length of the queue
+    uint32_t pending = __atomic_add_fetch(&start->pending, 1, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&start->deferred, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n((uint32_t *) address, head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&start->deferred, &head, entry, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (pending == __atomic_load_n(&start->wake_batch, __ATOMIC_RELAXED)){
+        syscall(SYS_futex, &start->pending, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+BYTE * trim_block(void * heapstart, BYTE * address){
+    //give the whole pages of the FREE block now covering a freed address back to the OS, return its end
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint64_t offset = address - start;
+    uint8_t size = read_min_size(heapstart);
+    while (*map_slot(heapstart, start + (offset & ~(pow_of_2(size) - 1))) == NO_BLOCK){
+        size ++;
+    }
+    BYTE * block = start + (offset & ~(pow_of_2(size) - 1));
+    HEADER header = *map_slot(heapstart, block);
+    if (read_status(header) == FREE && read_size(header) >= ((START *) heapstart)->trim){
+        uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t first = ((uintptr_t) block + page - 1) & ~(page - 1);
+        uintptr_t last = ((uintptr_t) block + pow_of_2(read_size(header))) & ~(page - 1);
+        if (first < last){
+            madvise((void *) first, last - first, MADV_DONTNEED);
+        }
+    }
+    return block + pow_of_2(read_size(header));
+}
+
+void deferred_free(void * heapstart, void ** ptrs, size_t n){
+    //free a batch of queued blocks, then trim what they merged into, the heap lock must be held
+    void * freed[DEFERRED_BATCH];
+    memcpy(freed, ptrs, n * sizeof(void *));
+    if (heap_free_batch(heapstart, ptrs, n) != 0 && validation(heapstart) != -1){
+        //a block was queued twice, free the rest one by one so they are not lost
+        for (size_t i = 0; i < n; i++){
+            HEADER * entry = map_entry(heapstart, freed[i]);
+            if (entry != NULL && read_status(*entry) == IN_USE){
+                release_block(heapstart, freed[i]);
+            }
+        }
+    }
+    if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+        //the merges went to the subtree counters, publish them for the next batch
+        sum_subtrees(heapstart);
+    }
+    if (((START *) heapstart)->trim == 0){
+        return;
+    }
+    qsort(freed, n, sizeof(void *), compare_address);
+    BYTE * end = NULL;
+    for (size_t i = 0; i < n; i++){
+        if ((BYTE *) freed[i] >= end){
+            end = trim_block(heapstart, freed[i]);
+        }
+    }
+}
+
+void deferred_drain(void * heapstart){
+    //free every queued block, the heap lock must be held
+    START * start = heapstart;
+    if (__atomic_load_n(&start->deferred, __ATOMIC_RELAXED) == 0){
+        return;
+    }
+    BYTE * space = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    uint32_t entry = __atomic_exchange_n(&start->deferred, 0, __ATOMIC_ACQUIRE);
+    //a block queued twice links the queue into a loop, so it is walked at most once per map entry
+    uint64_t limit = pow_of_2(read_init_size(heapstart) - read_min_size(heapstart));
+    uint64_t taken = 0;
+    void * batch[DEFERRED_BATCH];
+    size_t n = 0;
+    while (entry != 0 && taken < limit){
+        BYTE * address = space + ((uint64_t) (entry - 1) << read_min_size(heapstart));
+        entry = __atomic_load_n((uint32_t *) address, __ATOMIC_RELAXED);
+        batch[n] = address;
+        n ++;
+        taken ++;
+        if (n == DEFERRED_BATCH){
+            deferred_free(heapstart, batch, n);
+            n = 0;
+        }
+    }
+    if (n > 0){
+        deferred_free(heapstart, batch, n);
+    }
+    __atomic_sub_fetch(&start->pending, (uint32_t) taken, __ATOMIC_RELAXED);
+}
+
+void stack_refill(void * heapstart){
+    //fill the free stacks which ran low up to REFILL_DEPTH blocks, the heap lock must be held
+    if (!stack_path(heapstart)){
+        return;
+    }
+    for (uint8_t order = 0; order < STACK_ORDERS; order++){
+        STACK * stack = free_stacks(heapstart) + order;
+        while (__atomic_load_n(&stack->count, __ATOMIC_RELAXED) < REFILL_DEPTH){
+            void * ptr = heap_malloc(heapstart, pow_of_2(read_min_size(heapstart) + order));
+            if (ptr == NULL){
+                break;
+            }
+            if (stack_push(heapstart, order, ptr) != 0){
+                heap_free(heapstart, ptr);
+                break;
+            }
+            if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+                sum_subtrees(heapstart);
+            }
+        }
+    }
+    if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+        sum_subtrees(heapstart);
+    }
+}
+
+void maintenance_pass(void * heapstart){
+    //drain the queue and refill the free stacks, holding the heap lock
+    heap_lock(heapstart);
+    deferred_drain(heapstart);
+    stack_refill(heapstart);
+    heap_unlock(heapstart);
+}
+
+void * maintenance_run(void * arg){
+    //the maintenance thread, a pass every time it wakes until it is stopped
+    MAINTENANCE * maintenance = arg;
+    START * start = maintenance->heap;
+    struct timespec interval = {maintenance->interval / 1000, (maintenance->interval % 1000) * 1000000L};
+    while (!__atomic_load_n(&maintenance->stop, __ATOMIC_ACQUIRE)){
+        uint32_t pending = __atomic_load_n(&start->pending, __ATOMIC_RELAXED);
+        if (pending < __atomic_load_n(&start->wake_batch, __ATOMIC_RELAXED)){
+            syscall(SYS_futex, &start->pending, FUTEX_WAIT_PRIVATE, pending,
+                    maintenance->interval != 0 ? &interval : NULL, NULL, 0);
+            if (__atomic_load_n(&maintenance->stop, __ATOMIC_ACQUIRE)){
+                break;
+            }
+        }
+        maintenance_pass(start);
+    }
+    return NULL;
+}
+
+int virtual_maintenance_start(void * heapstart, uint32_t wake_batch, uint32_t interval, uint8_t trim) {
+    /*
+     * Start the maintenance thread of a heap, waking after wake_batch queued frees or interval milliseconds,
+     * and trimming merged FREE blocks of at least 2^trim bytes, 0 for never
+     * Return 1 if the heap already has one or the thread could not be started
+     */
+    if (heapstart == NULL || wake_batch == 0 || shape_validation(heapstart) == -1 || tlsf_path(heapstart)){
+        return 1;
+    }
+    START * start = heapstart;
+    pthread_mutex_lock(&maintenance_lock);
+    for (MAINTENANCE * maintenance = maintenance_registry; maintenance != NULL; maintenance = maintenance->next){
+        if (maintenance->heap == heapstart){
+            pthread_mutex_unlock(&maintenance_lock);
+            return 1;
+        }
+    }
+    MAINTENANCE * maintenance = calloc(1, sizeof(MAINTENANCE));
+    if (maintenance == NULL){
+        pthread_mutex_unlock(&maintenance_lock);
+        return 1;
+    }
+    maintenance->heap = heapstart;
+    maintenance->interval = interval;
+    start->trim = trim;
+    __atomic_store_n(&start->wake_batch, wake_batch, __ATOMIC_RELEASE);
+    if (pthread_create(&maintenance->thread, NULL, maintenance_run, maintenance) != 0){
+        __atomic_store_n(&start->wake_batch, 0, __ATOMIC_RELAXED);
+        free(maintenance);
+        pthread_mutex_unlock(&maintenance_lock);
+        return 1;
+    }
+    maintenance->next = maintenance_registry;
+    maintenance_registry = maintenance;
+    pthread_mutex_unlock(&maintenance_lock);
+    return 0;
+}
+
+int virtual_maintenance_drain(void * heapstart) {
+    //do a maintenance pass in the calling thread, so every queued free is merged on return
+    if (heapstart == NULL || shape_validation(heapstart) == -1){
+        return 1;
+    }
+    maintenance_pass(heapstart);
+    return 0;
+}
+
+int virtual_maintenance_stop(void * heapstart) {
+    //stop the maintenance thread of a heap and drain what it left, return 1 if the heap has none
+    if (heapstart == NULL){
+        return 1;
+    }
+    START * start = heapstart;
+    pthread_mutex_lock(&maintenance_lock);
+    MAINTENANCE ** link = &maintenance_registry;
+    while (*link != NULL && (*link)->heap != heapstart){
+        link = &(*link)->next;
+    }
+    MAINTENANCE * maintenance = *link;
+    if (maintenance == NULL){
+        pthread_mutex_unlock(&maintenance_lock);
+        return 1;
+    }
+    *link = maintenance->next;
+    pthread_mutex_unlock(&maintenance_lock);
+
+    //frees stop queueing, then the thread is woken out of its wait
+    __atomic_store_n(&start->wake_batch, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&maintenance->stop, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&start->pending, 1, __ATOMIC_RELAXED);
+    syscall(SYS_futex, &start->pending, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    pthread_join(maintenance->thread, NULL);
+    __atomic_sub_fetch(&start->pending, 1, __ATOMIC_RELAXED);
+    free(maintenance);
+
+    heap_lock(heapstart);
+    deferred_drain(heapstart);
+    heap_unlock(heapstart);
+    return 0;
+}
+
+void * shared_malloc(void * heapstart, uint32_t size) {
+    //allocate from the heap shared by every thread, popping a stacked block first
+    if (stack_path(heapstart)){
+        if (shape_validation(heapstart)==-1 || size == 0){
+            return NULL;
+        }
+        int fit = fit_size(heapstart,size);
+        if (fit >= 0 && fit - read_min_size(heapstart) < STACK_ORDERS){
+            void * ptr = stack_pop(heapstart,fit - read_min_size(heapstart));
+            if (ptr != NULL){
+                return ptr;
+            }
+        }
+    }
+    //read before trying too, as the maintenance thread may merge the queued blocks while the call fails
+    int queued = deferred_queued(heapstart);
+    void * ptr = buddy_malloc(heapstart,size);
+    if (ptr == NULL && size != 0 && (stack_path(heapstart) || queued || deferred_queued(heapstart))){
+        //the stacked and queued blocks may merge into what is missing
+        heap_lock(heapstart);
+        stack_drain(heapstart);
+        deferred_drain(heapstart);
+        ptr = heap_malloc(heapstart,size);
+        heap_unlock(heapstart);
+    }
+    return ptr;
+}
+
+int shared_free(void * heapstart, void * ptr) {
+    //free to the heap shared by every thread, pushing a block of a stacked size or queueing it for maintenance
+    if (!stack_path(heapstart) && !deferred_path(heapstart)){
+        return buddy_free(heapstart,ptr);
+    }
+    if (shape_validation(heapstart)==-1){
+        return 1;
+    }
+    //read without a lock, see map_entry
+    HEADER * entry = map_entry(heapstart,ptr);
+    if (entry == NULL){
+        return 1;
+    }
+    if (read_status(*entry) == FREE){
+        return buddy_free(heapstart,ptr);
+    }
+    uint8_t order = read_size(*entry) - read_min_size(heapstart);
+    if (stack_path(heapstart) && order < STACK_ORDERS && stack_push(heapstart,order,ptr) == 0){
+        return 0;
+    }
+    if (deferred_path(heapstart)){
+        deferred_push(heapstart,ptr);
+        return 0;
+    }
+    return buddy_free(heapstart,ptr);
+}
+
+/*
+ * Thread Cache
+ * Used only by heaps initialized with MODE_TCACHE, see TCACHE in virtual_alloc.h
+ *
+ * Every thread keeps up to TCACHE_COUNT blocks of each of the TCACHE_ORDERS smallest sizes,
+ * for one heap at a time. Cached blocks stay IN_USE in the block map, so virtual_info shows
+ * them as allocated and no other thread can take them, and a cache hit in virtual_malloc
+ * or virtual_free writes no header and takes no lock.
+ *
+ * An empty bin is refilled with TCACHE_BATCH blocks at once, and a full bin gives its
+ * TCACHE_BATCH oldest blocks back at once, through the subtree lock of the thread
+ * with MODE_SUBTREE_LOCKS, or one heap lock and a batch free otherwise.
+ * As other threads cannot take cached blocks, a cache holds at most 1 / 2^TCACHE_SHARE
+ * of the allocating space, so a few threads cannot hold all of a small heap between them.
+ * A cache is flushed when its thread exits, calls virtual_tcache_flush, or moves to another heap,
+ * and dropped without flushing if its heap was initialized again.
+ * MODE_PARANOID bypasses the cache.
+ */
+
+static __thread TCACHE thread_cache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+int tcache_current(TCACHE * cache){
+    //check if the heap of a cache is still the heap its blocks came from
+    START * start = cache->heap;
+    return start != NULL && start->magic == HEAP_MAGIC && start->generation == cache->generation;
+}
+
+void tcache_release(void * heapstart, void ** blocks, size_t n){
+    //give cached blocks back to the heap
+    if (subtree_path(heapstart)){
+        for (size_t i = 0; i < n; i++){
+            subtree_free(heapstart,blocks[i]);
+        }
+        return;
+    }
+    heap_lock(heapstart);
+    heap_free_batch(heapstart,blocks,n);
+    heap_unlock(heapstart);
+}
+
+size_t tcache_refill(void * heapstart, uint8_t fit, void ** blocks, size_t batch){
+    //allocate up to batch blocks of the given size for a bin, return how many were allocated
+    size_t n = 0;
+    if (subtree_path(heapstart)){
+        while (n < batch && (blocks[n] = subtree_malloc(heapstart,pow_of_2(fit))) != NULL){
+            n ++;
+        }
+        return n;
+    }
+    heap_lock(heapstart);
+    if (validation(heapstart) == 0){
+        while (n < batch && (blocks[n] = allocate_block(heapstart,fit)) != NULL){
+            n ++;
+        }
+    }
+    heap_unlock(heapstart);
+    return n;
+}
+
+void tcache_flush(TCACHE * cache){
+    //give every cached block back to its heap and unbind the cache
+    if (tcache_current(cache)){
+        for (uint8_t order = 0; order < TCACHE_ORDERS; order++){
+            tcache_release(cache->heap,cache->bins[order],cache->counts[order]);
+        }
+    }
+    memset(cache->counts, 0, sizeof(cache->counts));
+    cache->cached = 0;
+    cache->heap = NULL;
+}
+
+void tcache_exit(void * cache){
+    //drain the cache of an exiting thread
+    tcache_flush(cache);
+}
+
+void tcache_key_create(void){
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+TCACHE * tcache_bind(void * heapstart){
+    //the cache of this thread, flushed and bound to the given heap if it holds blocks of another one
+    TCACHE * cache = &thread_cache;
+    START * start = heapstart;
+    if (cache->heap == heapstart && cache->generation == start->generation){
+        return cache;
+    }
+    tcache_flush(cache);
+    pthread_once(&tcache_once, tcache_key_create);
+    pthread_setspecific(tcache_key, cache);
+    cache->heap = heapstart;
+    cache->generation = start->generation;
+    return cache;
+}
+
+void * tcache_malloc(void * heapstart, uint32_t size) {
+    //pop a cached block of the fitting size, refilling its bin if it is empty
+    if (shape_validation(heapstart)==-1 || size == 0){
+        return NULL;
+    }
+    int fit = fit_size(heapstart,size);
+    if (fit < 0 || fit - read_min_size(heapstart) >= TCACHE_ORDERS){
+        return shared_malloc(heapstart,size);
+    }
+    TCACHE * cache = tcache_bind(heapstart);
+    uint8_t order = fit - read_min_size(heapstart);
+    if (cache->counts[order] == 0){
+        uint64_t share = pow_of_2(read_init_size(heapstart) - TCACHE_SHARE);
+        if (cache->cached + pow_of_2(fit) > share){
+            //the cache holds its share of the heap already
+            return shared_malloc(heapstart,size);
+        }
+        uint64_t room = (share - cache->cached) >> fit;
+        size_t batch = room < TCACHE_BATCH ? room : TCACHE_BATCH;
+        cache->counts[order] = tcache_refill(heapstart,fit,cache->bins[order],batch);
+        cache->cached += cache->counts[order] * pow_of_2(fit);
+        if (cache->counts[order] == 0){
+            //the blocks cached in other bins may be what the heap is missing
+            tcache_flush(cache);
+            return shared_malloc(heapstart,size);
+        }
+    }
+    cache->counts[order] --;
+    cache->cached -= pow_of_2(fit);
+    return cache->bins[order][cache->counts[order]];
+}
+
+int tcache_free(void * heapstart, void * ptr) {
+    //push a block of a cached size, giving the oldest blocks of its bin back if it is full
+    if (shape_validation(heapstart)==-1){
+        return 1;
+    }
+    //read without a lock, see map_entry
+    HEADER * entry = map_entry(heapstart,ptr);
+    if (entry == NULL){
+        return 1;
+    }
+    uint8_t order = read_size(*entry) - read_min_size(heapstart);
+    if (read_status(*entry) == FREE || order >= TCACHE_ORDERS){
+        return shared_free(heapstart,ptr);
+    }
+    TCACHE * cache = tcache_bind(heapstart);
+    if (cache->counts[order] == TCACHE_COUNT){
+        void * oldest[TCACHE_BATCH];
+        memcpy(oldest, cache->bins[order], sizeof(oldest));
+        tcache_release(heapstart,oldest,TCACHE_BATCH);
+        memmove(cache->bins[order], cache->bins[order] + TCACHE_BATCH, (TCACHE_COUNT - TCACHE_BATCH) * sizeof(void *));
+        cache->counts[order] -= TCACHE_BATCH;
+        cache->cached -= TCACHE_BATCH * pow_of_2(read_size(*entry));
+    }
+    if (cache->cached + pow_of_2(read_size(*entry)) > pow_of_2(read_init_size(heapstart) - TCACHE_SHARE)){
+        //the cache holds its share of the heap already
+        return shared_free(heapstart,ptr);
+    }
+    cache->bins[order][cache->counts[order]] = ptr;
+    cache->counts[order] ++;
+    cache->cached += pow_of_2(read_size(*entry));
+    return 0;
+}
+
+int tcache_path(void * heapstart){
+    //check if a call can go through the thread cache
+    return (read_mode(heapstart) & (MODE_TCACHE | MODE_PARANOID)) == MODE_TCACHE;
+}
+
+/*
+ * Slabs
+ * Used only by heaps with slabs, see virtual_slab_enable and SLAB in virtual_alloc.h
+ *
+ * A request of at most 2^(min_size - 2) bytes, and at most 2^(SLAB_MIN + SLAB_CLASSES - 1),
+ * is rounded up to a class of 2^SLAB_MIN, 2^(SLAB_MIN + 1) ... bytes instead of a whole block,
+ * and placed in a slab of its class: a block of 2^min_size bytes, taken from the buddy blocks
+ * with the header and free bitmap at its start and the objects after it.
+ * Slabs with free objects are linked into the partial list of their class in the directory,
+ * so an allocation takes the first bit of the first partial slab. A full slab leaves the list,
+ * and an empty one goes back to the buddy blocks at once.
+ *
+ * An object never starts a block, so virtual_free, virtual_free_batch and virtual_realloc tell it
+ * from a block by its address, and find its slab at the start of the min_size block holding it.
+ * virtual_malloc_batch does not use slabs, each of its requests takes a block of at least 2^min_size.
+ * The directory and every slab show as allocated blocks in virtual_info.
+ * The slab lock is only ever taken before the heap or subtree locks, never inside them.
+ */
+
+SLABS * slab_directory(void * heapstart){
+    //the slab directory, NULL if the heap has no slabs
+    uint32_t entry = __atomic_load_n(&((START *) heapstart)->slabs, __ATOMIC_ACQUIRE);
+    if (entry == 0){
+        return NULL;
+    }
+    return (SLABS *) ((BYTE *) (heapstart + HEAPSTART_SIZE) + ((uint64_t) (entry - 1) << read_min_size(heapstart)));
+}
+
+int slab_class(void * heapstart, uint32_t size){
+    //the class of a request, -1 if it goes to the buddy blocks
+    int class = SLAB_MIN;
+    while (pow_of_2(class) < size){
+        class ++;
+    }
+    if (size == 0 || class > read_min_size(heapstart) - 2 || class >= SLAB_MIN + SLAB_CLASSES){
+        return -1;
+    }
+    return class;
+}
+
+SLAB * slab_at(void * heapstart, uint32_t entry){
+    //the slab of a block map entry + 1, NULL for 0
+    if (entry == 0){
+        return NULL;
+    }
+    return (SLAB *) ((BYTE *) (heapstart + HEAPSTART_SIZE) + ((uint64_t) (entry - 1) << read_min_size(heapstart)));
+}
+
+uint32_t slab_entry(void * heapstart, SLAB * slab){
+    //the block map entry + 1 of a slab
+    return (((BYTE *) slab - (BYTE *) (heapstart + HEAPSTART_SIZE)) >> read_min_size(heapstart)) + 1;
+}
+
+SLAB * slab_of(void * heapstart, void * ptr){
+    //the slab holding an object, NULL if ptr is not inside a slab
+    BYTE * start = (BYTE *) (heapstart + HEAPSTART_SIZE);
+    if (slab_directory(heapstart) == NULL || (BYTE *) ptr < start){
+        return NULL;
+    }
+    uint64_t offset = (BYTE *) ptr - start;
+    if (offset >= pow_of_2(read_init_size(heapstart)) || offset % pow_of_2(read_min_size(heapstart)) == 0){
+        return NULL;
+    }
+    BYTE * block = start + (offset & ~(pow_of_2(read_min_size(heapstart)) - 1));
+    if (*map_slot(heapstart, block) != make_header(IN_USE, read_min_size(heapstart)) || ((SLAB *) block)->magic != SLAB_MAGIC){
+        return NULL;
+    }
+    return (SLAB *) block;
+}
+
+void slab_link(void * heapstart, SLAB * slab){
+    //put a slab at the head of the partial list of its class, the slab lock must be held
+    SLABS * slabs = slab_directory(heapstart);
+    uint32_t * head = &slabs->partial[slab->class - SLAB_MIN];
+    slab->prev = 0;
+    slab->next = *head;
+    if (*head != 0){
+        slab_at(heapstart, *head)->prev = slab_entry(heapstart, slab);
+    }
+    *head = slab_entry(heapstart, slab);
+}
+
+void slab_unlink(void * heapstart, SLAB * slab){
+    //take a slab out of the partial list of its class, the slab lock must be held
+    SLABS * slabs = slab_directory(heapstart);
+    if (slab->prev != 0){
+        slab_at(heapstart, slab->prev)->next = slab->next;
+    } else {
+        slabs->partial[slab->class - SLAB_MIN] = slab->next;
+    }
+    if (slab->next != 0){
+        slab_at(heapstart, slab->next)->prev = slab->prev;
+    }
+}
+
+void slab_format(void * heapstart, SLAB * slab, uint8_t class){
+    //make a fresh block a slab of a class with every object free
+    uint32_t objects = pow_of_2(read_min_size(heapstart) - class);
+    uint32_t words = (objects + 63) / 64;
+    uint32_t align = class < 4 ? pow_of_2(class) : 16;
+    slab->magic = SLAB_MAGIC;
+    slab->class = class;
+    slab->reserved = 0;
+    slab->first = (sizeof(SLAB) + words * sizeof(uint64_t) + align - 1) & ~(align - 1);
+    slab->count = (pow_of_2(read_min_size(heapstart)) - slab->first) >> class;
+    slab->used = 0;
+    for (uint32_t i = 0; i < words; i++){
+        if (slab->count >= (i + 1) * 64){
+            slab->free[i] = ~0ull;
+        } else if (slab->count > i * 64){
+            slab->free[i] = pow_of_2(slab->count - i * 64) - 1;
+        } else {
+            slab->free[i] = 0;
+        }
+    }
+}
+
+void * slab_malloc(void * heapstart, uint8_t class){
+    //take the first free object of the first partial slab of a class, starting a new slab if there is none
+    if (shape_validation(heapstart)==-1){
+        return NULL;
+    }
+    SLABS * slabs = slab_directory(heapstart);
+    mutex_lock(&slabs->lock, &slabs->spins);
+    SLAB * slab = slab_at(heapstart, slabs->partial[class - SLAB_MIN]);
+    if (slab == NULL){
+        slab = shared_malloc(heapstart, pow_of_2(read_min_size(heapstart)));
+        if (slab == NULL){
+            mutex_unlock(&slabs->lock);
+            return NULL;
+        }
+        slab_format(heapstart, slab, class);
+        slab_link(heapstart, slab);
+    }
+    uint32_t word = 0;
+    while (slab->free[word] == 0){
+        word ++;
+    }
+    uint32_t bit = __builtin_ctzll(slab->free[word]);
+    slab->free[word] &= ~(1ull << bit);
+    slab->used ++;
+    if (slab->used == slab->count){
+        slab_unlink(heapstart, slab);
+    }
+    mutex_unlock(&slabs->lock);
+    return (BYTE *) slab + slab->first + ((uint64_t) (word * 64 + bit) << class);
+}
+
+int64_t slab_object(SLAB * slab, BYTE * ptr){
+    //the index of an allocated object of a slab, -1 if ptr is not an object or a free one, the slab lock must be held
+    uint64_t offset = ptr - (BYTE *) slab;
+    uint64_t object = (offset - slab->first) >> slab->class;
+    if (offset < slab->first || (offset - slab->first) % pow_of_2(slab->class) != 0 || object >= slab->count ||
+        (slab->free[object / 64] >> (object % 64)) & 1){
+        return -1;
+    }
+    return object;
+}
+
+int slab_release(void * heapstart, SLAB * slab, uint64_t object){
+    //mark an object free, return 1 if its slab is now empty and goes back to the buddy blocks, the slab lock must be held
+    slab->free[object / 64] |= 1ull << (object % 64);
+    slab->used --;
+    if (slab->used == 0){
+        if (slab->count > 1){
+            slab_unlink(heapstart, slab);
+        }
+        slab->magic = 0;
+        return 1;
+    }
+    if (slab->used == slab->count - 1){
+        //it was full
+        slab_link(heapstart, slab);
+    }
+    return 0;
+}
 
-    uint64_t blocks = virtual_sbrk(0) - (void *)header_ptr;
-    uint64_t counter = 0;
-    while (counter < blocks){
-        //continue reading and printing blocks
-        if (read_status(*header_ptr) == FREE){
-            printf("free %lu\n",pow_of_2(read_size(*header_ptr)));
-        } else if (read_status(*header_ptr) == IN_USE){
-            printf("allocated %lu\n",pow_of_2(read_size(*header_ptr)));
+int slab_free(void * heapstart, SLAB * slab, BYTE * ptr){
+    //give an object back to its slab, giving the slab back to the buddy blocks once it is empty
+    SLABS * slabs = slab_directory(heapstart);
+    mutex_lock(&slabs->lock, &slabs->spins);
+    int64_t object = slab_object(slab, ptr);
+    if (object < 0){
+        mutex_unlock(&slabs->lock);
+        return 1;
+    }
+    int empty = slab_release(heapstart, slab, object);
+    mutex_unlock(&slabs->lock);
+    return empty ? shared_free(heapstart, slab) : 0;
+}
+
+int virtual_slab_enable(void * heapstart) {
+    //give a heap slabs for small objects before it is shared, return 1 if min_size is below SLAB_MIN_SIZE or it has them
+    if (heapstart == NULL || shape_validation(heapstart) == -1 || read_min_size(heapstart) < SLAB_MIN_SIZE ||
+        slab_directory(heapstart) != NULL){
+        return 1;
+    }
+    SLABS * slabs = shared_malloc(heapstart, sizeof(SLABS));
+    if (slabs == NULL){
+        return 1;
+    }
+    memset(slabs, 0, sizeof(SLABS));
+    __atomic_store_n(&((START *) heapstart)->slabs, slab_entry(heapstart, (SLAB *) slabs), __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Public functions
+ * With MODE_THREAD_SAFE, each call holds the heap lock from validation to return,
+ * except on the paths below, which only check heap start until they take a lock
+ * With MODE_SUBTREE_LOCKS, single block calls go through the subtree paths
+ * With MODE_TCACHE, virtual_malloc and virtual_free go through the thread cache
+ * With MODE_LOCK_FREE, virtual_malloc and virtual_free of the smallest sizes go through the free stacks
+ * With a maintenance thread, virtual_free queues the block for it, see Maintenance
+ * With slabs, small objects are placed in slabs, see Slabs
+ */
+
+void * virtual_malloc(void * heapstart, uint32_t size) {
+    if(heapstart==NULL){
+        return NULL;
+    }
+    if (tlsf_path(heapstart)){
+        heap_lock(heapstart);
+        void * ptr = tlsf_malloc(heapstart,size);
+        heap_unlock(heapstart);
+        return ptr;
+    }
+    if (slab_directory(heapstart) != NULL && slab_class(heapstart,size) >= 0){
+        return slab_malloc(heapstart,slab_class(heapstart,size));
+    }
+    if (tcache_path(heapstart)){
+        return tcache_malloc(heapstart,size);
+    }
+    return shared_malloc(heapstart,size);
+}
+
+int virtual_malloc_batch(void * heapstart, const uint32_t * sizes, void ** out, size_t n) {
+    if(heapstart==NULL){
+        return 1;
+    }
+    heap_lock(heapstart);
+    int result = tlsf_path(heapstart) ? tlsf_malloc_batch(heapstart,sizes,out,n) : heap_malloc_batch(heapstart,sizes,out,n);
+    heap_unlock(heapstart);
+    return result;
+}
+
+int virtual_free(void * heapstart, void * ptr) {
+    if(heapstart==NULL){
+        return 1;
+    }
+    if (tlsf_path(heapstart)){
+        heap_lock(heapstart);
+        int result = tlsf_free(heapstart,ptr);
+        heap_unlock(heapstart);
+        return result;
+    }
+    SLAB * slab = slab_of(heapstart,ptr);
+    if (slab != NULL){
+        return slab_free(heapstart,slab,ptr);
+    }
+    if (tcache_path(heapstart)){
+        return tcache_free(heapstart,ptr);
+    }
+    return shared_free(heapstart,ptr);
+}
+
+int virtual_free_batch(void * heapstart, void ** ptrs, size_t n) {
+    /*
+     * Free n blocks and slab objects, or none if one is not allocated or appears twice
+     * ptrs is reordered, slab objects first and each part sorted by address,
+     * and every entry is set to NULL once everything is freed
+     */
+    if(heapstart==NULL || ptrs==NULL){
+        return 1;
+    }
+    SLABS * slabs = slab_directory(heapstart);
+    if (slabs == NULL){
+        heap_lock(heapstart);
+        int result = tlsf_path(heapstart) ? tlsf_free_batch(heapstart,ptrs,n) : heap_free_batch(heapstart,ptrs,n);
+        heap_unlock(heapstart);
+        return result;
+    }
+    size_t objects = 0;
+    for (size_t i = 0; i < n; i++){
+        if (slab_of(heapstart,ptrs[i]) != NULL){
+            void * object = ptrs[i];
+            ptrs[i] = ptrs[objects];
+            ptrs[objects] = object;
+            objects ++;
+        }
+    }
+    if (objects > 0){
+        //every object is checked before anything is freed, and the slab lock keeps them allocated until they are
+        mutex_lock(&slabs->lock, &slabs->spins);
+        qsort(ptrs, objects, sizeof(void *), compare_address);
+        for (size_t i = 0; i < objects; i++){
+            if (slab_object(slab_of(heapstart,ptrs[i]),ptrs[i]) < 0 || (i > 0 && ptrs[i] == ptrs[i - 1])){
+                mutex_unlock(&slabs->lock);
+                return 1;
+            }
+        }
+    }
+    heap_lock(heapstart);
+    int result = tlsf_path(heapstart) ? tlsf_free_batch(heapstart,ptrs + objects,n - objects) : heap_free_batch(heapstart,ptrs + objects,n - objects);
+    heap_unlock(heapstart);
+    if (objects > 0){
+        //the slabs left empty are collected at the front of ptrs, and given back once the slab lock is released
+        size_t empty = 0;
+        for (size_t i = 0; i < objects && result == 0; i++){
+            SLAB * slab = slab_of(heapstart,ptrs[i]);
+            if (slab_release(heapstart,slab,slab_object(slab,ptrs[i]))){
+                ptrs[empty] = slab;
+                empty ++;
+            }
+        }
+        mutex_unlock(&slabs->lock);
+        for (size_t i = 0; i < empty; i++){
+            shared_free(heapstart,ptrs[i]);
+        }
+        for (size_t i = 0; i < objects && result == 0; i++){
+            ptrs[i] = NULL;
+        }
+    }
+    return result;
+}
+
+void * virtual_realloc(void * heapstart, void * ptr, uint32_t size) {
+    if(heapstart==NULL){
+        return NULL;
+    }
+    if (tlsf_path(heapstart)){
+        heap_lock(heapstart);
+        void * new_address = tlsf_realloc(heapstart,ptr,size);
+        heap_unlock(heapstart);
+        return new_address;
+    }
+    SLAB * slab = slab_of(heapstart,ptr);
+    if (slab != NULL){
+        //an object keeps its place while its class still fits, else it moves
+        if (size != 0 && slab_class(heapstart,size) == slab->class){
+            return ptr;
+        }
+        void * moved = NULL;
+        if (size != 0){
+            moved = virtual_malloc(heapstart,size);
+            if (moved == NULL){
+                return NULL;
+            }
+            memcpy(moved,ptr,size < pow_of_2(slab->class) ? size : pow_of_2(slab->class));
+        }
+        slab_free(heapstart,slab,ptr);
+        return moved;
+    }
+    void * new_address;
+    int queued = deferred_queued(heapstart);
+    if (subtree_path(heapstart)){
+        new_address = subtree_realloc(heapstart,ptr,size);
+    } else {
+        heap_lock(heapstart);
+        new_address = heap_realloc(heapstart,ptr,size);
+        heap_unlock(heapstart);
+    }
+    if (new_address == NULL && ptr != NULL && size != 0 && (stack_path(heapstart) || queued || deferred_queued(heapstart))){
+        //the stacked and queued blocks may merge into what is missing, the block is left as it was
+        heap_lock(heapstart);
+        stack_drain(heapstart);
+        deferred_drain(heapstart);
+        new_address = heap_realloc(heapstart,ptr,size);
+        heap_unlock(heapstart);
+    }
+    return new_address;
+}
+
+void virtual_info(void * heapstart) {
+    if(heapstart==NULL){
+        return;
+    }
+    heap_lock(heapstart);
+    if (tlsf_path(heapstart)){
+        tlsf_info(heapstart);
+        heap_unlock(heapstart);
+        return;
+    }
+    if (read_mode(heapstart) & MODE_LOCK_FREE){
+        stack_drain(heapstart);
+    }
+    deferred_drain(heapstart);
+    heap_info(heapstart);
+    heap_unlock(heapstart);
+}
+
+void virtual_tcache_flush(void * heapstart) {
+    //give the blocks cached by this thread for the given heap back
+    if (heapstart != NULL && thread_cache.heap == heapstart){
+        tcache_flush(&thread_cache);
+    }
+}
+
+int virtual_stats(void * heapstart, STATS * stats) {
+    //read the statistics counters without taking a lock, return 1 if the heap has none
+    if (heapstart == NULL || stats == NULL || shape_validation(heapstart) == -1 || !(read_mode(heapstart) & MODE_STATS)){
+        return 1;
+    }
+    memset(stats, 0, sizeof(STATS));
+    for (uint64_t set = 0; set < subtree_count(heapstart); set++){
+        COUNTERS * counters = stats_counters(heapstart) + set;
+        uint64_t * blocks = &((START *) heapstart)->blocks;
+        uint64_t * free_size = &((START *) heapstart)->free_size;
+        if (read_mode(heapstart) & MODE_SUBTREE_LOCKS){
+            blocks = &subtree_locks(heapstart)[set].blocks;
+            free_size = &subtree_locks(heapstart)[set].free_size;
+        }
+        uint64_t free_blocks[STATS_SIZES];
+        uint64_t block_count;
+        uint64_t free_count;
+        uint32_t sequence;
+        do {
+            sequence = __atomic_load_n(&counters->sequence, __ATOMIC_ACQUIRE);
+            block_count = __atomic_load_n(blocks, __ATOMIC_RELAXED);
+            free_count = __atomic_load_n(free_size, __ATOMIC_RELAXED);
+            for (uint8_t size = 0; size < STATS_SIZES; size++){
+                free_blocks[size] = __atomic_load_n(&counters->free_blocks[size], __ATOMIC_RELAXED);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while ((sequence & 1) || sequence != __atomic_load_n(&counters->sequence, __ATOMIC_RELAXED));
+        stats->blocks += block_count;
+        stats->free_size += free_count;
+        for (uint8_t size = 0; size < STATS_SIZES; size++){
+            stats->free_blocks[size] += free_blocks[size];
+        }
+    }
+    stats->used_size = pow_of_2(read_init_size(heapstart)) - stats->free_size;
+    stats->largest = -1;
+    for (uint8_t size = 0; size < STATS_SIZES; size++){
+        if (stats->free_blocks[size] != 0){
+            stats->largest = size;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Epochs
+ * Deferred reclamation for lock-free data structures built on virtual heaps, shared by every heap
+ *
+ * A reader wraps every access to shared blocks in virtual_epoch_enter and virtual_epoch_exit,
+ * which only announce the global epoch in the record of its thread. A block unlinked from a
+ * shared structure is passed to virtual_retire instead of virtual_free, and waits in a bag
+ * of its thread tagged with the epoch it was retired in.
+ *
+ * The global epoch moves on from e only once every thread inside a critical section has seen e,
+ * so once it is at e + 2, no reader can still hold a block retired in e, and the bags
+ * of e are freed with virtual_free_batch. Retired blocks are never written to, as readers
+ * may still be reading them, so the bags are blocks of their own, allocated in the same heap.
+ *
+ * The registry of thread records is only locked to add or remove a thread, and to move the epoch,
+ * which is tried whenever a thread starts a new bag. With no room for a new bag, a thread outside
+ * a critical section waits for the epoch to move twice and frees the block itself, so it never fails,
+ * and one inside keeps filling its last bag, tagged with the current epoch. A thread exiting with bags not freed yet
+ * hands them to the orphan list, freed by whoever moves the epoch next.
+ * A heap must not be initialized again while blocks retired to it wait, see virtual_epoch_synchronize.
+ */
+
+static __thread EPOCH thread_epoch;
+static uint64_t global_epoch = 1;
+static EPOCH * epoch_registry = NULL;
+static RETIRED * epoch_orphans = NULL;
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+
+void epoch_free_bag(RETIRED * bag){
+    //free the blocks in a bag with one batch, then the bag itself
+    if (virtual_free_batch(bag->heap, bag->blocks, bag->count) != 0){
+        //the batch frees nothing if one block is not valid, so the others are freed one by one
+        for (uint32_t i = 0; i < bag->count; i++){
+            virtual_free(bag->heap, bag->blocks[i]);
+        }
+    }
+    virtual_free(bag->heap, bag);
+}
+
+RETIRED * epoch_reclaim(RETIRED * bags, uint64_t epoch){
+    //free the bags, newest first, retired before the given epoch - 1, return the rest
+    RETIRED ** link = &bags;
+    while (*link != NULL && (*link)->epoch + 2 > epoch){
+        link = &(*link)->next;
+    }
+    RETIRED * bag = *link;
+    *link = NULL;
+    while (bag != NULL){
+        RETIRED * next = bag->next;
+        epoch_free_bag(bag);
+        bag = next;
+    }
+    return bags;
+}
+
+uint64_t epoch_advance(void){
+    //move the global epoch on if every thread in a critical section has seen it, return the global epoch
+    pthread_mutex_lock(&epoch_lock);
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    int behind = 0;
+    for (EPOCH * record = epoch_registry; record != NULL; record = record->next){
+        uint64_t active = __atomic_load_n(&record->active, __ATOMIC_SEQ_CST);
+        if (active != 0 && active != epoch){
+            behind = 1;
+            break;
+        }
+    }
+    if (!behind){
+        epoch ++;
+        __atomic_store_n(&global_epoch, epoch, __ATOMIC_SEQ_CST);
+    }
+    //orphans are not sorted by epoch, so every one is checked
+    RETIRED ** link = &epoch_orphans;
+    while (*link != NULL){
+        RETIRED * bag = *link;
+        if (bag->epoch + 2 <= epoch){
+            *link = bag->next;
+            epoch_free_bag(bag);
         } else {
+            link = &bag->next;
+        }
+    }
+    pthread_mutex_unlock(&epoch_lock);
+    return epoch;
+}
+
+void epoch_exit_thread(void * arg){
+    //unregister an exiting thread, handing its bags to the orphan list
+    EPOCH * record = arg;
+    pthread_mutex_lock(&epoch_lock);
+    if (record->prev != NULL){
+        record->prev->next = record->next;
+    } else {
+        epoch_registry = record->next;
+    }
+    if (record->next != NULL){
+        record->next->prev = record->prev;
+    }
+    while (record->limbo != NULL){
+        RETIRED * bag = record->limbo;
+        record->limbo = bag->next;
+        bag->next = epoch_orphans;
+        epoch_orphans = bag;
+    }
+    record->registered = 0;
+    pthread_mutex_unlock(&epoch_lock);
+}
+
+void epoch_key_create(void){
+    pthread_key_create(&epoch_key, epoch_exit_thread);
+}
+
+EPOCH * epoch_record(void){
+    //the record of this thread, added to the registry on first use
+    EPOCH * record = &thread_epoch;
+    if (!record->registered){
+        pthread_once(&epoch_once, epoch_key_create);
+        pthread_setspecific(epoch_key, record);
+        pthread_mutex_lock(&epoch_lock);
+        record->prev = NULL;
+        record->next = epoch_registry;
+        if (epoch_registry != NULL){
+            epoch_registry->prev = record;
+        }
+        epoch_registry = record;
+        record->registered = 1;
+        pthread_mutex_unlock(&epoch_lock);
+    }
+    return record;
+}
+
+void virtual_epoch_enter(void) {
+    //enter a critical section, announcing the global epoch until it stops moving
+    EPOCH * record = epoch_record();
+    if (record->nesting ++ > 0){
+        return;
+    }
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    while (1){
+        __atomic_store_n(&record->active, epoch, __ATOMIC_SEQ_CST);
+        uint64_t current = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        if (current == epoch){
             return;
         }
-        header_ptr += HEADER_SIZE;
-        counter ++;
+        epoch = current;
     }
 }
 
-int available_size(void * heapstart, HEADER * previous, HEADER * next, uint8_t size, uint8_t serial){
-    //preform a false-free operation, the data needed for this false-block is in parameters
-    if (size >= read_init_size(heapstart)){
-        //break recursion
-        return size;
+void virtual_epoch_exit(void) {
+    //leave a critical section, the outermost one stops holding back the epoch
+    EPOCH * record = &thread_epoch;
+    if (record->nesting == 0){
+        return;
     }
+    if (-- record->nesting == 0){
+        __atomic_store_n(&record->active, 0, __ATOMIC_RELEASE);
+    }
+}
 
-    //calculating serial number and recursively compute just like free
-    if(serial % 2 == 0){
-        if(size == read_size(*next) && read_status(*next) == FREE){
-            return available_size(heapstart,previous,next+1,size+1, serial/2);
-        }else{
-            return size;
+int virtual_retire(void * heapstart, void * ptr) {
+    //free a block once no critical section can still reach it, return 1 if it cannot be retired
+    if (heapstart == NULL || ptr == NULL || shape_validation(heapstart) == -1){
+        return 1;
+    }
+    if (tlsf_path(heapstart)){
+        //TLSF blocks have no block map, and their boundary tags change with every merge around them
+        heap_lock(heapstart);
+        TLSF_BLOCK * block = tlsf_entry(heapstart,ptr);
+        heap_unlock(heapstart);
+        if (block == NULL){
+            return 1;
         }
-    }else if (serial % 2 == 1) {
-        if(size == read_size(*previous) && read_status(*previous) == FREE){
-            return available_size(heapstart,previous-1,next,size+1, serial/2);
-        }else{
-            return size;
+    } else if (map_entry(heapstart,ptr) == NULL){
+        return 1;
+    }
+    EPOCH * record = epoch_record();
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    RETIRED * bag = record->limbo;
+    if (bag == NULL || bag->heap != heapstart || bag->epoch != epoch || bag->count == EPOCH_BATCH){
+        //a new bag is a good time to move the epoch and free what is old enough
+        epoch = epoch_advance();
+        record->limbo = epoch_reclaim(record->limbo, epoch);
+        bag = record->limbo;
+        RETIRED * fresh = virtual_malloc(heapstart, sizeof(RETIRED));
+        if (fresh == NULL && record->nesting == 0){
+            //outside a critical section, no reader can hold the block once the epoch moved twice
+            virtual_epoch_synchronize();
+            return virtual_free(heapstart, ptr);
+        }
+        if (fresh != NULL){
+            fresh->next = record->limbo;
+            fresh->heap = heapstart;
+            fresh->epoch = epoch;
+            fresh->count = 0;
+            record->limbo = bag = fresh;
+        } else if (bag != NULL && bag->heap == heapstart && bag->count < EPOCH_BATCH){
+            //no room for a bag, tagging the last one with a later epoch only frees it later
+            bag->epoch = epoch;
+        } else {
+            return 1;
         }
     }
+    bag->blocks[bag->count] = ptr;
+    bag->count ++;
+    return 0;
+}
 
-    return -1;
+int virtual_epoch_synchronize(void) {
+    //wait until every block retired by this thread and by exited threads is freed, return 1 inside a critical section
+    EPOCH * record = epoch_record();
+    if (record->nesting > 0){
+        return 1;
+    }
+    uint64_t target = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) + 2;
+    while (epoch_advance() < target){
+        sched_yield();
+    }
+    //the orphans are checked by one more move
+    record->limbo = epoch_reclaim(record->limbo, epoch_advance());
+    return 0;
+}
+
+/*
+ * Regions
+ * Bump allocation of scratch objects freed all at once, built on the public functions of any heap
+ *
+ * A region is a chain of chunks, blocks of 2^order bytes taken with virtual_malloc. The first chunk
+ * starts with the REGION itself, every other one with a pointer to the chunk chained before it.
+ * An object is placed at the top of the newest chunk rounded up to its alignment, and a request that
+ * does not fit chains a new chunk, leaving the rest of the old one unused.
+ * A request larger than a chunk gets an oversized chunk of its own, chained behind the newest chunk,
+ * which keeps serving the others. Behind the first chunk, that link is the prev of the REGION.
+ * Objects are never freed one by one, virtual_region_destroy frees every chunk with virtual_free_batch.
+ * A region is used by one thread at a time, on a heap of any mode.
+ */
+
+REGION * virtual_region_create(void * heapstart, uint8_t order) {
+    //take the first chunk, holding the region, NULL if the heap has no room
+    if (heapstart == NULL || order >= 32 || pow_of_2(order) < sizeof(REGION)){
+        return NULL;
+    }
+    REGION * region = virtual_malloc(heapstart, pow_of_2(order));
+    if (region == NULL){
+        return NULL;
+    }
+    region->prev = NULL;
+    region->heap = heapstart;
+    region->top = (BYTE *) (region + 1);
+    region->end = (BYTE *) region + pow_of_2(order);
+    region->chunk = region;
+    region->order = order;
+    return region;
+}
+
+void * region_grow(REGION * region, uint32_t size, uint32_t align){
+    //chain a chunk with room for a request the newest chunk cannot hold, and place it there
+    uint64_t bytes = sizeof(void *) + (uint64_t) size + align - 1;
+    int oversized = bytes > pow_of_2(region->order);
+    if (!oversized){
+        bytes = pow_of_2(region->order);
+    }
+    if (bytes > UINT32_MAX){
+        return NULL;
+    }
+    void ** chunk = virtual_malloc(region->heap, bytes);
+    if (chunk == NULL){
+        return NULL;
+    }
+    uintptr_t address = ((uintptr_t) (chunk + 1) + align - 1) & ~(uintptr_t) (align - 1);
+    void ** newest = region->chunk;
+    if (oversized){
+        //holds this request only, behind the newest chunk
+        chunk[0] = newest[0];
+        newest[0] = chunk;
+        return (void *) address;
+    }
+    chunk[0] = newest;
+    region->chunk = chunk;
+    region->top = (BYTE *) address + size;
+    region->end = (BYTE *) chunk + bytes;
+    return (void *) address;
+}
+
+void * virtual_region_alloc(REGION * region, uint32_t size, uint32_t align) {
+    //place an object aligned to a power of 2, or to REGION_ALIGN if align is 0, NULL if the heap has no room
+    if (align == 0){
+        align = REGION_ALIGN;
+    }
+    if (region == NULL || size == 0 || (align & (align - 1)) != 0){
+        return NULL;
+    }
+    uintptr_t address = ((uintptr_t) region->top + align - 1) & ~(uintptr_t) (align - 1);
+    if (address + size <= (uintptr_t) region->end){
+        region->top = (BYTE *) address + size;
+        return (void *) address;
+    }
+    return region_grow(region, size, align);
+}
+
+int virtual_region_destroy(REGION * region) {
+    //free every chunk of a region down to the first one and those behind it, return 1 if a chunk is not a block of its heap
+    if (region == NULL){
+        return 1;
+    }
+    void * heapstart = region->heap;
+    void ** chunk = region->chunk;
+    void * batch[REGION_BATCH];
+    int result = 0;
+    while (chunk != NULL){
+        //the link is read before its chunk is freed
+        size_t n = 0;
+        while (chunk != NULL && n < REGION_BATCH){
+            batch[n] = chunk;
+            n ++;
+            chunk = chunk[0];
+        }
+        result |= virtual_free_batch(heapstart, batch, n);
+    }
+    return result;
+}
+
+/*
+ * Pools
+ * Objects of one size taken from chunks of a heap of the buddy engines, see POOL in virtual_alloc.h
+ *
+ * A chunk is a block of 2^order bytes, the smallest holding objects_per_chunk objects after its
+ * header and bitmap, so it holds as many as fit. It starts at a multiple of 2^order in the allocating space,
+ * so an object finds its chunk by clearing the low bits of its offset, without a header of its own.
+ * An allocation pops the free list of the first partial chunk, or takes its next fresh object,
+ * and a free pushes the object back, so neither writes the block map. The bitmap of the chunk
+ * marks the allocated objects, so an object freed twice is caught before it is linked again.
+ * A chunk moves to the full list when its last object is allocated, and goes back to the heap
+ * as soon as its last object is freed. The pool lock is only ever taken before the heap locks.
+ */
+
+uint32_t pool_words(uint32_t objects){
+    //the words of the bitmap of a chunk holding a number of objects
+    return (objects + 63) / 64;
+}
+
+BYTE * pool_objects(POOL * pool, POOL_CHUNK * chunk){
+    //the first object of a chunk, after its bitmap
+    return (BYTE *) (chunk->allocated + pool_words(pool->per_chunk));
+}
 
+void pool_link(POOL_CHUNK ** head, POOL_CHUNK * chunk){
+    //put a chunk at the head of a list of its pool, the pool lock must be held
+    chunk->prev = NULL;
+    chunk->next = *head;
+    if (*head != NULL){
+        (*head)->prev = chunk;
+    }
+    *head = chunk;
+}
+
+void pool_unlink(POOL_CHUNK ** head, POOL_CHUNK * chunk){
+    //take a chunk out of a list of its pool, the pool lock must be held
+    if (chunk->prev != NULL){
+        chunk->prev->next = chunk->next;
+    } else {
+        *head = chunk->next;
+    }
+    if (chunk->next != NULL){
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+POOL_CHUNK * pool_chunk(POOL * pool){
+    //take a new chunk from the heap into the partial list, NULL if there is no room, the pool lock must be held
+    POOL_CHUNK * chunk = virtual_malloc(pool->heap, pow_of_2(pool->order));
+    if (chunk == NULL){
+        return NULL;
+    }
+    chunk->pool = pool;
+    chunk->free = NULL;
+    chunk->used = 0;
+    chunk->fresh = 0;
+    memset(chunk->allocated, 0, pool_words(pool->per_chunk) * sizeof(uint64_t));
+    pool_link(&pool->partial, chunk);
+    pool->chunks ++;
+    return chunk;
+}
+
+POOL_CHUNK * pool_chunk_of(POOL * pool, BYTE * ptr){
+    /*
+     * The chunk holding an allocated object of the pool, NULL if ptr is not one, the pool lock must be held
+     * The block map is read without the heap lock. The pool lock keeps the chunks of the pool, so their
+     * entries stay IN_USE of 2^order and their headers are only written under it. Another block may be
+     * split, merged or allocated meanwhile, then the entry or its first word is read while it changes,
+     * which can only fail the check, unless the caller passes a block it owns holding the pool, as with free(3).
+     */
+    BYTE * start = (BYTE *) (pool->heap + HEAPSTART_SIZE);
+    if (ptr < start || (uint64_t) (ptr - start) >= pow_of_2(read_init_size(pool->heap))){
+        return NULL;
+    }
+    POOL_CHUNK * chunk = (POOL_CHUNK *) (start + ((ptr - start) & ~(pow_of_2(pool->order) - 1)));
+    if (*map_slot(pool->heap, (BYTE *) chunk) != make_header(IN_USE, pool->order) || chunk->pool != pool ||
+        ptr < pool_objects(pool, chunk)){
+        return NULL;
+    }
+    uint64_t offset = ptr - pool_objects(pool, chunk);
+    uint64_t object = offset / pool->object_size;
+    if (offset % pool->object_size != 0 || object >= chunk->fresh || !((chunk->allocated[object / 64] >> (object % 64)) & 1)){
+        //not an object, or a free one
+        return NULL;
+    }
+    return chunk;
+}
+
+POOL * virtual_pool_create(void * heapstart, uint32_t object_size, uint32_t objects_per_chunk) {
+    //a pool of objects of object_size bytes, NULL if a chunk does not fit the heap or the heap uses the TLSF engine
+    if (shape_validation(heapstart) == -1 || tlsf_path(heapstart) || object_size == 0 || objects_per_chunk == 0){
+        return NULL;
+    }
+    //every object can hold the link of the free list
+    uint64_t stride = ((uint64_t) object_size + POOL_ALIGN - 1) & ~(uint64_t) (POOL_ALIGN - 1);
+    uint64_t bytes = sizeof(POOL_CHUNK) + pool_words(objects_per_chunk) * sizeof(uint64_t) + stride * objects_per_chunk;
+    if (bytes > UINT32_MAX || bytes > pow_of_2(read_init_size(heapstart))){
+        return NULL;
+    }
+    POOL * pool = virtual_malloc(heapstart, sizeof(POOL));
+    if (pool == NULL){
+        return NULL;
+    }
+    memset(pool, 0, sizeof(POOL));
+    pool->heap = heapstart;
+    pool->object_size = stride;
+    pool->order = fit_size(heapstart, bytes);
+    //as many objects as fit with their bits, at least objects_per_chunk
+    uint64_t space = pow_of_2(pool->order) - sizeof(POOL_CHUNK);
+    pool->per_chunk = space / stride;
+    while (pool_words(pool->per_chunk) * sizeof(uint64_t) + stride * pool->per_chunk > space){
+        pool->per_chunk --;
+    }
+    return pool;
+}
+
+void * virtual_pool_alloc(POOL * pool) {
+    //take an object from the first partial chunk, NULL if the heap has no room for a new chunk
+    if (pool == NULL){
+        return NULL;
+    }
+    mutex_lock(&pool->lock, &pool->spins);
+    POOL_CHUNK * chunk = pool->partial;
+    if (chunk == NULL && (chunk = pool_chunk(pool)) == NULL){
+        mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    BYTE * object = chunk->free;
+    if (object != NULL){
+        chunk->free = *(void **) object;
+    } else {
+        object = pool_objects(pool, chunk) + (uint64_t) chunk->fresh * pool->object_size;
+        chunk->fresh ++;
+    }
+    uint64_t index = (object - pool_objects(pool, chunk)) / pool->object_size;
+    chunk->allocated[index / 64] |= 1ull << (index % 64);
+    chunk->used ++;
+    pool->used ++;
+    if (chunk->used == pool->per_chunk){
+        pool_unlink(&pool->partial, chunk);
+        pool_link(&pool->full, chunk);
+    }
+    mutex_unlock(&pool->lock);
+    return object;
+}
+
+int virtual_pool_free(POOL * pool, void * ptr) {
+    //give an object back to its chunk, and an empty chunk back to the heap, return 1 if ptr is not an allocated object of the pool
+    if (pool == NULL || ptr == NULL){
+        return 1;
+    }
+    mutex_lock(&pool->lock, &pool->spins);
+    POOL_CHUNK * chunk = pool_chunk_of(pool, ptr);
+    if (chunk == NULL){
+        mutex_unlock(&pool->lock);
+        return 1;
+    }
+    uint64_t index = ((BYTE *) ptr - pool_objects(pool, chunk)) / pool->object_size;
+    chunk->allocated[index / 64] &= ~(1ull << (index % 64));
+    *(void **) ptr = chunk->free;
+    chunk->free = ptr;
+    chunk->used --;
+    pool->used --;
+    if (chunk->used == pool->per_chunk - 1){
+        //it was full
+        pool_unlink(&pool->full, chunk);
+        pool_link(&pool->partial, chunk);
+    }
+    if (chunk->used == 0){
+        pool_unlink(&pool->partial, chunk);
+        pool->chunks --;
+        chunk->pool = NULL;
+        mutex_unlock(&pool->lock);
+        return virtual_free(pool->heap, chunk);
+    }
+    mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int virtual_pool_stats(POOL * pool, POOL_STATS * stats) {
+    //take a snapshot of the occupancy of a pool, return 1 without a pool
+    if (pool == NULL || stats == NULL){
+        return 1;
+    }
+    mutex_lock(&pool->lock, &pool->spins);
+    stats->object_size = pool->object_size;
+    stats->per_chunk = pool->per_chunk;
+    stats->chunks = pool->chunks;
+    stats->capacity = pool->chunks * pool->per_chunk;
+    stats->used = pool->used;
+    mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int virtual_pool_destroy(POOL * pool) {
+    //give every chunk, with the objects still allocated in it, and the pool back to the heap
+    if (pool == NULL){
+        return 1;
+    }
+    void * heapstart = pool->heap;
+    POOL_CHUNK * lists[2] = {pool->partial, pool->full};
+    int result = 0;
+    for (int i = 0; i < 2; i++){
+        POOL_CHUNK * chunk = lists[i];
+        while (chunk != NULL){
+            POOL_CHUNK * next = chunk->next;
+            chunk->pool = NULL;
+            result |= virtual_free(heapstart, chunk);
+            chunk = next;
+        }
+    }
+    return result | virtual_free(heapstart, pool);
+}
+
+int available_size(void * heapstart, BYTE * address, uint8_t size){
+    //preform a false-free operation on the block at the given address, return the size it would merge to
+    if (size >= read_init_size(heapstart)){
+        //break recursion
+        return size;
+    }
+
+    //find the buddy by the serial and recursively compute just like free
+    uint64_t serial = (address - (BYTE *) (heapstart + HEAPSTART_SIZE)) >> size;
+    BYTE * buddy_address = (BYTE *) (heapstart + HEAPSTART_SIZE) + ((serial ^ 1) << size);
+    HEADER * buddy = map_entry(heapstart, buddy_address);
+    if (buddy != NULL && read_size(*buddy) == size && read_status(*buddy) == FREE){
+        return available_size(heapstart, serial % 2 == 1 ? buddy_address : address, size + 1);
+    }
+    return size;
 }
 
 uint64_t pow_of_2(uint8_t power){
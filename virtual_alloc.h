@@ -2,25 +2,371 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #define BYTE uint8_t
 #define HEADER uint8_t
-#define START uint8_t
+#define INDEX uint64_t
+#define TREE_NODE uint32_t
+#define START struct virtual_start
+#define LOCK struct virtual_lock
+#define TCACHE struct virtual_tcache
+#define STACK struct virtual_stack
+#define EPOCH struct virtual_epoch
+#define RETIRED struct virtual_retired
+#define COUNTERS struct virtual_counters
+#define STATS struct virtual_stats
+#define MAINTENANCE struct virtual_maintenance
+#define SLAB struct virtual_slab
+#define SLABS struct virtual_slabs
+#define TLSF struct virtual_tlsf
+#define TLSF_BLOCK struct virtual_tlsf_block
+#define REGION struct virtual_region
+#define POOL struct virtual_pool
+#define POOL_CHUNK struct virtual_pool_chunk
+#define POOL_STATS struct virtual_pool_stats
 #define HEADER_SIZE 1
-#define HEAPSTART_SIZE 2
+#define INDEX_BITS 64
+#define INDEX_LEVELS 11
+#define HEAPSTART_SIZE 64
+#define HEAP_MAGIC 0x76697274
 #define FREE 0
 #define IN_USE 1
+#define NO_BLOCK 0xFF
+#define WEIGHTED 0x40
+#define MODE_BITMAP 0
+#define MODE_TREE 1
+#define MODE_PARANOID 2
+#define MODE_THREAD_SAFE 4
+#define MODE_SUBTREE_LOCKS 8
+#define MODE_TCACHE 16
+#define MODE_LOCK_FREE 32
+#define MODE_PER_CPU 64
+#define MODE_STATS 128
+#define ENGINE_BUDDY 0
+#define ENGINE_TLSF 1
+#define ENGINE_WEIGHTED 2
+#define LOCK_SPIN_MIN 16
+#define LOCK_SPIN_MAX 1024
+#define LOCK_SIZE 64
+#define SUBTREE_DEPTH_DEFAULT 5
+#define SUBTREE_DEPTH_MAX 8
+#define STEAL_BATCH 7
+#define TCACHE_ORDERS 8
+#define TCACHE_COUNT 16
+#define TCACHE_BATCH 8
+#define TCACHE_SHARE 3
+#define STACK_ORDERS 4
+#define STACK_DEPTH 64
+#define STACK_SHARE 4
+#define EPOCH_BATCH 60
+#define STATS_SIZES 64
+#define DEFERRED_BATCH 64
+#define REFILL_DEPTH 16
+#define SLAB_MIN 3
+#define SLAB_CLASSES 8
+#define SLAB_MIN_SIZE 6
+#define SLAB_MAGIC 0x736c6162
+#define TLSF_ALIGN 3
+#define TLSF_SL_BITS 4
+#define TLSF_FL_COUNT 25
+#define TLSF_HEADER 8
+#define TLSF_MIN_BLOCK 16
+#define TLSF_FREE 1
+#define REGION_ALIGN 8
+#define REGION_BATCH 64
+#define POOL_ALIGN 8
+
+/*
+ * Heap start, at the beginning of every virtual heap
+ * Building with -DVIRTUAL_PARANOID turns on MODE_PARANOID for every heap
+ * With MODE_THREAD_SAFE, heapstart must be at least 4 byte aligned for the lock
+ */
+struct virtual_start {
+    uint8_t init_size;
+    uint8_t min_size;
+    uint8_t mode;
+    uint8_t lock_depth; //depth of the subtrees with their own lock in MODE_SUBTREE_LOCKS, 0 otherwise
+    uint32_t magic;
+    uint64_t blocks;    //number of blocks in the block map
+    uint64_t free_size; //total size of FREE blocks
+    uint64_t checksum;  //XOR of the hash of every header with its position
+    uint32_t lock;      //heap lock of MODE_THREAD_SAFE
+    uint32_t lock_spins;//average number of spins needed to take the lock
+    uint8_t heap_held;  //set while every subtree lock is held in MODE_SUBTREE_LOCKS
+    uint8_t trim;       //size as a power of 2 from which merged FREE blocks go back to the OS, 0 for never
+    uint8_t engine;     //ENGINE_BUDDY, ENGINE_TLSF or ENGINE_WEIGHTED, set by the init_allocator variant used
+    uint32_t generation;//different every time a heap is initialized, so thread caches notice
+    uint32_t deferred;  //block map entry + 1 of the last block queued for the maintenance thread, 0 if none
+    uint32_t pending;   //number of blocks queued, the maintenance thread sleeps on it
+    uint32_t wake_batch;//pending count waking the maintenance thread, 0 when none runs
+    uint32_t slabs;     //block map entry + 1 of the slab directory, 0 without slabs
+};
+
+/*
+ * Subtree lock, one for each subtree of MODE_SUBTREE_LOCKS, on its own cache line
+ * The counters are summed into heap start whenever every subtree lock is taken
+ * The stash holds blocks this subtree stole from others, as block map entries
+ * The remote free queue is on the next cache line, so pushes by other threads do not bounce the lock
+ */
+struct virtual_lock {
+    uint32_t lock;
+    uint32_t spins;
+    uint64_t blocks;    //the counters of heap start, for the headers in the subtree
+    uint64_t free_size;
+    uint64_t checksum;
+    uint32_t stolen;    //number of blocks in the stash
+    uint32_t stash[STEAL_BATCH];
+    uint32_t remote;    //block map entry + 1 of the last block freed by another subtree, 0 if none
+    uint8_t padding[LOCK_SIZE - 4];
+};
+
+/*
+ * Lock-free free stack of MODE_LOCK_FREE, one for each of the STACK_ORDERS smallest sizes, on its own cache line
+ * Head: low 32 bits, 1 + the block map entry of the top block, 0 when empty
+ *       high 32 bits, a tag counting every change of the head
+ */
+struct virtual_stack {
+    uint64_t head;
+    uint32_t count;     //about how many blocks are in the stack
+    uint8_t padding[LOCK_SIZE - 12];
+};
+
+/*
+ * Statistics counters of MODE_STATS, one set for each subtree lock, or one for the heap lock
+ * The sequence is odd while the lock is held, so readers can tell when the counters are changing
+ */
+struct virtual_counters {
+    uint32_t sequence;
+    uint32_t reserved;
+    uint64_t free_blocks[STATS_SIZES];  //number of FREE blocks of size 2^k
+    uint8_t padding[LOCK_SIZE - 8];
+};
+
+/*
+ * Statistics snapshot filled by virtual_stats
+ */
+struct virtual_stats {
+    uint64_t blocks;    //number of blocks, FREE or IN_USE
+    uint64_t free_size; //total size of FREE blocks
+    uint64_t used_size; //total size of IN_USE blocks
+    int8_t largest;     //size of the largest FREE block as a power of 2, -1 if none
+    uint64_t free_blocks[STATS_SIZES];
+};
+
+/*
+ * Block of the TLSF engine, at the start of every block, FREE or not
+ * The links are only used while the block is FREE, an allocated block gives them to its data
+ */
+struct virtual_tlsf_block {
+    uint32_t prev_size; //size of the block before it in the allocating space, 0 for the first block
+    uint32_t size;      //size of the block with this header, a multiple of 2^TLSF_ALIGN, TLSF_FREE set while FREE
+    uint32_t next;      //offset + 1 of the blocks around it in its free list, 0 if none
+    uint32_t prev;
+};
+
+/*
+ * Free lists of the TLSF engine, after the allocating space
+ * List (fl, sl) holds FREE blocks of sizes 2^(fl + 6) + sl * 2^(fl + 2) up to the next list, for fl >= 1,
+ * and of size sl * 2^TLSF_ALIGN for fl 0
+ */
+struct virtual_tlsf {
+    uint32_t fl_bitmap;                     //bit fl set if a list of first level fl is not empty
+    uint32_t sl_bitmap[TLSF_FL_COUNT];      //bit sl set if list (fl, sl) is not empty
+    uint32_t heads[TLSF_FL_COUNT][1 << TLSF_SL_BITS];   //offset + 1 of the first block of every list, 0 if empty
+};
+
+/*
+ * Slab, one buddy block of 2^min_size bytes carved into objects of 2^class bytes
+ * The header is at the start of the block, the objects follow it from offset first
+ */
+struct virtual_slab {
+    uint32_t magic;     //SLAB_MAGIC while the block is a slab
+    uint8_t class;
+    uint8_t reserved;
+    uint16_t first;
+    uint32_t count;     //number of objects
+    uint32_t used;      //number of objects allocated
+    uint32_t prev;      //block map entry + 1 of the slabs around it in the partial list of its class, 0 if none
+    uint32_t next;
+    uint64_t free[];    //bit set for every free object
+};
+
+/*
+ * Slab directory, a buddy block of its own, found through heap start
+ */
+struct virtual_slabs {
+    uint32_t lock;
+    uint32_t spins;
+    uint32_t partial[SLAB_CLASSES]; //block map entry + 1 of the first slab of each class with free objects, 0 if none
+};
+
+/*
+ * Thread cache of MODE_TCACHE, in thread local storage
+ * Bin k holds IN_USE blocks of size min_size + k of one heap
+ * A cache holds at most 1 / 2^TCACHE_SHARE of the allocating space
+ */
+struct virtual_tcache {
+    void * heap;
+    uint32_t generation;
+    uint64_t cached;    //bytes held in all bins
+    uint8_t counts[TCACHE_ORDERS];
+    void * bins[TCACHE_ORDERS][TCACHE_COUNT];
+};
+
+/*
+ * Bag of blocks retired to one heap in one epoch, allocated in that heap
+ * EPOCH_BATCH is chosen so a bag fits a 512 byte block
+ */
+struct virtual_retired {
+    RETIRED * next;     //the bag retired before this one by the same thread
+    void * heap;
+    uint64_t epoch;
+    uint32_t count;
+    void * blocks[EPOCH_BATCH];
+};
+
+/*
+ * Epoch record of a thread, in thread local storage, linked into the registry of every thread
+ */
+struct virtual_epoch {
+    uint64_t active;    //the epoch seen when entering the outermost critical section, 0 outside
+    uint32_t nesting;
+    uint8_t registered;
+    RETIRED * limbo;    //bags of retired blocks not freed yet, newest first
+    EPOCH * prev;
+    EPOCH * next;
+};
+
+/*
+ * Maintenance thread of a heap, started by virtual_maintenance_start, linked into the registry of every one
+ */
+struct virtual_maintenance {
+    void * heap;
+    pthread_t thread;
+    uint32_t interval;  //milliseconds between passes without a wake up, 0 to wait for wake_batch only
+    uint8_t stop;
+    MAINTENANCE * next;
+};
+
+/*
+ * Region of bump allocated objects, at the start of its first chunk, see virtual_region_create
+ * Every chunk starts with a pointer to the chunk chained before it, prev for the first one
+ */
+struct virtual_region {
+    void * prev;        //the link of the first chunk: oversized chunks chained behind it while it was the newest, or NULL
+    void * heap;
+    BYTE * top;         //first free byte of the chunk allocated from
+    BYTE * end;         //end of the chunk allocated from
+    void * chunk;       //the chunk allocated from, the newest one of order size
+    uint8_t order;      //size of a chunk as a power of 2
+};
+
+/*
+ * Pool of objects of one size, allocated in its heap, see virtual_pool_create
+ */
+struct virtual_pool {
+    void * heap;
+    uint32_t lock;
+    uint32_t spins;
+    uint32_t object_size;   //bytes from one object to the next, a multiple of POOL_ALIGN
+    uint32_t per_chunk;     //objects in a chunk
+    uint8_t order;          //size of a chunk as a power of 2
+    uint64_t chunks;
+    uint64_t used;          //objects allocated
+    POOL_CHUNK * partial;   //chunks with a free object, the first one is allocated from
+    POOL_CHUNK * full;
+};
+
+/*
+ * Chunk of a pool, a buddy block of 2^order bytes with the objects after this header and its bitmap
+ * Freed objects are linked through their first word, the objects from fresh on were never allocated
+ */
+struct virtual_pool_chunk {
+    POOL * pool;
+    POOL_CHUNK * prev;      //chunks around it in the partial or full list of its pool
+    POOL_CHUNK * next;
+    void * free;
+    uint32_t used;
+    uint32_t fresh;
+    uint64_t allocated[];   //one bit for every object, set while it is allocated
+};
+
+/*
+ * Pool snapshot filled by virtual_pool_stats, the occupancy is used / capacity
+ */
+struct virtual_pool_stats {
+    uint32_t object_size;
+    uint32_t per_chunk;
+    uint64_t chunks;        //chunks held from the heap
+    uint64_t capacity;      //objects the chunks hold
+    uint64_t used;          //objects allocated
+};
 
 void init_allocator(void * heapstart, uint8_t initial_size, uint8_t min_size);
 
+void init_allocator_mode(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode);
+
+void init_allocator_subtrees(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode, uint8_t depth);
+
+void init_allocator_arenas(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode, uint32_t arenas);
+
+void init_allocator_tlsf(void * heapstart, uint8_t initial_size, uint8_t mode);
+
+void init_allocator_weighted(void * heapstart, uint8_t initial_size, uint8_t min_size, uint8_t mode);
+
 void * virtual_malloc(void * heapstart, uint32_t size);
 
+int virtual_malloc_batch(void * heapstart, const uint32_t * sizes, void ** out, size_t n);
+
 int virtual_free(void * heapstart, void * ptr);
 
+int virtual_free_batch(void * heapstart, void ** ptrs, size_t n);
+
 void * virtual_realloc(void * heapstart, void * ptr, uint32_t size);
 
 void virtual_info(void * heapstart);
 
-int available_size(void * heapstart, HEADER * previous, HEADER * next, uint8_t size, uint8_t serial);
+void virtual_tcache_flush(void * heapstart);
+
+int virtual_stats(void * heapstart, STATS * stats);
+
+void virtual_epoch_enter(void);
+
+void virtual_epoch_exit(void);
+
+int virtual_retire(void * heapstart, void * ptr);
+
+int virtual_epoch_synchronize(void);
+
+int virtual_maintenance_start(void * heapstart, uint32_t wake_batch, uint32_t interval, uint8_t trim);
+
+int virtual_maintenance_drain(void * heapstart);
+
+int virtual_maintenance_stop(void * heapstart);
+
+int virtual_slab_enable(void * heapstart);
+
+REGION * virtual_region_create(void * heapstart, uint8_t order);
+
+void * virtual_region_alloc(REGION * region, uint32_t size, uint32_t align);
+
+int virtual_region_destroy(REGION * region);
+
+POOL * virtual_pool_create(void * heapstart, uint32_t object_size, uint32_t objects_per_chunk);
+
+void * virtual_pool_alloc(POOL * pool);
+
+int virtual_pool_free(POOL * pool, void * ptr);
+
+int virtual_pool_stats(POOL * pool, POOL_STATS * stats);
+
+int virtual_pool_destroy(POOL * pool);
+
+int available_size(void * heapstart, BYTE * address, uint8_t size);
+
+LOCK * subtree_locks(void * heapstart);
+
+STACK * free_stacks(void * heapstart);
 
 uint64_t pow_of_2(uint8_t power);
\ No newline at end of file